@@ -3,10 +3,373 @@
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define BREAK() if(debug)raise(SIGTRAP);
 
-int main(int argc, char **argv) {
+#define OUTBUF (1<<20) // gen writes in blocks this big
+#define SAMPLE (1<<20) // bytes of the corpus used to guess the number of rules
+
+void
+usage(void)
+{
+	fputs(
+		"usage: koishi <command> [options]\n"
+		"  train [-j threads] [-o model.ksh] [-f v2|v3|v4|v4z] [-i model.ksh] corpus...\n"
+		"        trains on the lines of the corpus files, adding to the -i model if given\n"
+		"  gen [-n count] [-s seed] [-m maxbytes] model.ksh\n"
+		"        writes count generated strings to stdout, one per line\n"
+		"  stats model.ksh\n"
+		"  bench [-n count] model.ksh\n"
+		"  demo\n"
+		"        the old example program, saves test.ksh\n",
+		stderr);
+	exit(2);
+}
+
+double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+ksh_model_t*
+load(const char *path, uint32_t seed)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+	ksh_model_t *model = ksh_createmodel(16, NULL, seed);
+	int r = ksh_loadmodel(model, f);
+	if (r < 0) {
+		fprintf(stderr, "%s: loading failed (%d), file left at byte 0x%lx\n", path, r, ftell(f));
+		fclose(f);
+		ksh_freemodel(model);
+		return NULL;
+	}
+	fclose(f);
+	return model;
+}
+
+// a corpus file mapped into memory, split into lines without copying them
+struct corpus {
+	char *data;
+	size_t size;
+};
+
+int
+corpus_map(struct corpus *c, const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	c->size = st.st_size;
+	c->data = NULL;
+	if (c->size) {
+		c->data = mmap(NULL, c->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (c->data == MAP_FAILED) {
+			perror(path);
+			close(fd);
+			return -1;
+		}
+		madvise(c->data, c->size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	return 0;
+}
+
+size_t
+corpus_lines(struct corpus *c, const char **strings, size_t *lens)
+{
+	// counts the non-empty lines, and fills in the arrays if they aren't NULL
+	size_t n = 0;
+	char *p = c->data, *end = c->data + c->size;
+	while (p < end) {
+		char *nl = memchr(p, '\n', end - p);
+		char *eol = nl ? nl : end;
+		size_t len = eol - p;
+		if (len && p[len-1] == '\r')
+			len--;
+		if (len) {
+			if (strings) {
+				strings[n] = p;
+				lens[n] = len;
+			}
+			n++;
+		}
+		p = eol + 1;
+	}
+	return n;
+}
+
+int
+cmd_train(int argc, char **argv)
+{
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *out = "model.ksh", *format = "v4z", *in = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "j:o:f:i:")) != -1) {
+		switch (opt) {
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1)
+				usage();
+			break;
+		case 'o': out = optarg; break;
+		case 'f': format = optarg; break;
+		case 'i': in = optarg; break;
+		default: usage();
+		}
+	}
+	if (optind >= argc)
+		usage();
+	if (strcmp(format, "v2") && strcmp(format, "v3") && strcmp(format, "v4") && strcmp(format, "v4z"))
+		usage();
+
+	int nfiles = argc - optind;
+	struct corpus *corpora = calloc(sizeof(struct corpus), nfiles);
+	size_t n = 0, total = 0;
+	for (int i = 0; i < nfiles; i++) {
+		if (corpus_map(&corpora[i], argv[optind+i]) < 0)
+			return 1;
+		n += corpus_lines(&corpora[i], NULL, NULL);
+		total += corpora[i].size;
+	}
+	const char **strings = malloc((n ? n : 1) * sizeof(char*));
+	size_t *lens = malloc((n ? n : 1) * sizeof(size_t));
+	if (!strings || !lens) {
+		fputs("out of memory\n", stderr);
+		return 1;
+	}
+	size_t k = 0;
+	for (int i = 0; i < nfiles; i++)
+		k += corpus_lines(&corpora[i], strings + k, lens + k);
+
+	double t = now();
+	ksh_model_t *model = in ? load(in, 0) : ksh_createmodel(8, NULL, 0);
+	if (!model)
+		return 1;
+	// the hashmap can't grow while the threads are training, so it's sized up front
+	size_t sample = corpora[0].size < SAMPLE ? corpora[0].size : SAMPLE;
+	uint64_t expected = ksh_estimaterules(corpora[0].data, sample, total);
+	if (ksh_reserve(model, model->nrules + expected) < 0
+			|| ksh_trainmarkov_parallel(model, strings, lens, n, threads) < 0) {
+		fputs("training failed\n", stderr);
+		return 1;
+	}
+	double trained = now() - t;
+
+	FILE *f = fopen(out, "w");
+	if (!f) {
+		perror(out);
+		return 1;
+	}
+	int r = 0;
+	if (!strcmp(format, "v2"))
+		ksh_savemodel(model, f);
+	else if (!strcmp(format, "v3"))
+		r = ksh_savemodel_chunked(model, f, threads > 1 ? threads * 4 : 1);
+	else
+		r = ksh_savemodel_packed(model, f, !strcmp(format, "v4z"));
+	if (fclose(f) != 0 || r < 0) {
+		fprintf(stderr, "%s: saving failed\n", out);
+		return 1;
+	}
+	fprintf(stderr, "trained on %zu strings (%zu bytes) in %.2fs with %d threads, %lu rules\n",
+		n, total, trained, threads, (unsigned long)model->nrules);
+	ksh_freemodel(model);
+	for (int i = 0; i < nfiles; i++)
+		if (corpora[i].size)
+			munmap(corpora[i].data, corpora[i].size);
+	free(corpora);
+	free(strings);
+	free(lens);
+	return 0;
+}
+
+int
+cmd_gen(int argc, char **argv)
+{
+	uint64_t count = 10;
+	uint64_t seed = time(NULL) ^ getpid();
+	size_t maxbytes = 256;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:s:m:")) != -1) {
+		switch (opt) {
+		case 'n': count = strtoull(optarg, NULL, 10); break;
+		case 's': seed = strtoull(optarg, NULL, 10); break;
+		case 'm': maxbytes = strtoull(optarg, NULL, 10); break;
+		default: usage();
+		}
+	}
+	if (optind != argc-1 || maxbytes == 0 || maxbytes > OUTBUF/2)
+		usage();
+	ksh_model_t *model = load(argv[optind], 0);
+	if (!model)
+		return 1;
+	ksh_setrng(model, KSH_RNG_PCG, seed);
+	ksh_freezemodel(model);
+	// strings are generated straight into the output buffer, which gets
+	// written out whenever the next one might not fit anymore
+	char *buf = malloc(OUTBUF);
+	size_t used = 0;
+	for (uint64_t i = 0; i < count; i++) {
+		if (OUTBUF - used < maxbytes + 2) {
+			if (fwrite(buf, 1, used, stdout) != used)
+				return 1;
+			used = 0;
+		}
+		ksh_createstring(model, buf + used, maxbytes + 1);
+		used += strlen(buf + used);
+		buf[used++] = '\n';
+	}
+	if (fwrite(buf, 1, used, stdout) != used || fflush(stdout) != 0)
+		return 1;
+	free(buf);
+	ksh_freemodel(model);
+	return 0;
+}
+
+int
+cmd_stats(int argc, char **argv)
+{
+	if (argc != 2)
+		usage();
+	struct stat st;
+	if (stat(argv[1], &st) < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	ksh_model_t *model = load(argv[1], 0);
+	if (!model)
+		return 1;
+	uint64_t hashmapbytes = sizeof(ksh_rule_t*) << model->mapsize;
+	uint64_t poolbytes = model->rulepool.live * sizeof(ksh_rule_t)
+		+ model->contpool.live * sizeof(ksh_continuations_t);
+	int mapsize = model->mapsize;
+	if (ksh_freezemodel(model) < 0) {
+		fputs("freezing failed\n", stderr);
+		return 1;
+	}
+	ksh_frozen_t *fz = model->frozen;
+	ksh_frozenrule_t *rules = (ksh_frozenrule_t*)((char*)fz + fz->ruleoff);
+	uint32_t *buckets = (uint32_t*)((char*)fz + fz->bucketoff);
+	uint64_t transitions = 0, single = 0, maxconts = 0, maxchain = 0, used = 0;
+	for (uint32_t i = 0; i < fz->nrules; i++) {
+		transitions += rules[i].probtotal;
+		if (rules[i].count == 1)
+			single++;
+		if (rules[i].count > maxconts)
+			maxconts = rules[i].count;
+	}
+	for (uint64_t b = 0; b < ((uint64_t)1 << fz->mapsize); b++) {
+		uint64_t chain = buckets[b+1] - buckets[b];
+		if (chain)
+			used++;
+		if (chain > maxchain)
+			maxchain = chain;
+	}
+	printf("file:          %s, %lu bytes\n", argv[1], (unsigned long)st.st_size);
+	printf("rules:         %lu\n", (unsigned long)fz->nrules);
+	printf("continuations: %lu (%.2f per rule, %.1f%% of rules have one, at most %lu)\n",
+		(unsigned long)fz->nconts, fz->nrules ? (double)fz->nconts / fz->nrules : 0,
+		fz->nrules ? 100.0 * single / fz->nrules : 0, (unsigned long)maxconts);
+	printf("transitions:   %lu\n", (unsigned long)transitions);
+	printf("hashmap:       2^%d buckets, %.1f%% used, longest chain %lu\n",
+		mapsize, 100.0 * used / ((uint64_t)1 << fz->mapsize), (unsigned long)maxchain);
+	printf("memory:        %.1f MB trainable, %.1f MB frozen\n",
+		(hashmapbytes + poolbytes) / 1e6, fz->size / 1e6);
+	ksh_freemodel(model);
+	return 0;
+}
+
+int
+cmd_bench(int argc, char **argv)
+{
+	uint64_t count = 100000;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n': count = strtoull(optarg, NULL, 10); break;
+		default: usage();
+		}
+	}
+	if (optind != argc-1 || count == 0)
+		usage();
+	double t = now();
+	ksh_model_t *model = load(argv[optind], 1);
+	if (!model)
+		return 1;
+	printf("load:             %.3fs, %lu rules\n", now() - t, (unsigned long)model->nrules);
+
+	char buf[256];
+	uint64_t bytes = 0;
+	t = now();
+	for (uint64_t i = 0; i < count; i++) {
+		ksh_createstring(model, buf, sizeof(buf));
+		bytes += strlen(buf);
+	}
+	t = now() - t;
+	printf("generate:         %.0f strings/s, %.1f MB/s\n", count / t, bytes / t / 1e6);
+
+	t = now();
+	ksh_freezemodel(model);
+	printf("freeze:           %.3fs\n", now() - t);
+	bytes = 0;
+	t = now();
+	for (uint64_t i = 0; i < count; i++) {
+		ksh_createstring(model, buf, sizeof(buf));
+		bytes += strlen(buf);
+	}
+	t = now() - t;
+	printf("generate frozen:  %.0f strings/s, %.1f MB/s\n", count / t, bytes / t / 1e6);
+
+	t = now();
+	for (uint64_t i = 0; i < count; i++) {
+		ksh_gen_t *gen = ksh_gen_begin(model);
+		ksh_gen_next(gen);
+		ksh_gen_free(gen);
+	}
+	printf("first character:  %.2fus\n", (now() - t) / count * 1e6);
+
+	// scoring what was generated, in batches
+	#define BENCH_BATCH 1024
+	char (*strs)[64] = malloc(BENCH_BATCH * 64);
+	const char *ptrs[BENCH_BATCH];
+	double scores[BENCH_BATCH];
+	for (int i = 0; i < BENCH_BATCH; i++) {
+		ksh_createstring(model, strs[i], 64);
+		ptrs[i] = strs[i];
+	}
+	uint64_t scored = 0;
+	t = now();
+	while (scored < count) {
+		ksh_scorestrings(model, ptrs, BENCH_BATCH, scores);
+		scored += BENCH_BATCH;
+	}
+	t = now() - t;
+	printf("score:            %.0f strings/s\n", scored / t);
+	free(strs);
+	ksh_freemodel(model);
+	return 0;
+}
+
+int
+cmd_demo(void)
+{
 	puts("koishi.c - libkoishi example program");
 
 	int debug = 0;
@@ -74,15 +437,9 @@ int main(int argc, char **argv) {
 
 	BREAK();
 
-	model = ksh_createmodel(8, NULL, 0x51d3b00b);
-	f = fopen("test.ksh", "r");
-	int r = ksh_loadmodel(model, f);
-	if (r < 0) {
-		printf("Loading model failed (%d), file left at byte 0x%x\n", r, ftell(f));
-		fclose(f);
+	model = load("test.ksh", 0x51d3b00b);
+	if (!model)
 		return 1;
-	}
-	fclose(f);
 	BREAK();
 	printf("Loaded model again from file\n");
 	for (int i = 0; i < 10; i++) {
@@ -91,4 +448,21 @@ int main(int argc, char **argv) {
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2)
+		usage();
+	// every command parses its own options, with its name as argv[0]
+	if (!strcmp(argv[1], "train"))
+		return cmd_train(argc-1, argv+1);
+	if (!strcmp(argv[1], "gen"))
+		return cmd_gen(argc-1, argv+1);
+	if (!strcmp(argv[1], "stats"))
+		return cmd_stats(argc-1, argv+1);
+	if (!strcmp(argv[1], "bench"))
+		return cmd_bench(argc-1, argv+1);
+	if (!strcmp(argv[1], "demo"))
+		return cmd_demo();
+	usage();
+}
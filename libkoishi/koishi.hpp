@@ -0,0 +1,192 @@
+#ifndef _KOISHI_HPP
+#define _KOISHI_HPP
+// header-only c++17 wrapper around libkoishi.h, nothing in here allocates
+// anything the c functions underneath wouldn't
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include "libkoishi.h"
+
+namespace koishi {
+
+class Model {
+public:
+	explicit Model(int mapsize = 16, uint32_t seed = 0)
+		: m(ksh_createmodel(mapsize, nullptr, seed))
+	{
+		if (!m)
+			throw std::bad_alloc();
+	}
+	// takes ownership of a model made with the c api
+	explicit Model(ksh_model_t *model) noexcept : m(model) {}
+	static Model sized(uint64_t expected_rules, uint32_t seed = 0)
+	{
+		return checked(ksh_createmodel_sized(expected_rules, nullptr, seed));
+	}
+	static Model load(std::FILE *f, int mapsize = 16, uint32_t seed = 0)
+	{
+		Model model(mapsize, seed);
+		if (ksh_loadmodel(model.m, f) < 0)
+			throw std::runtime_error("koishi: can't load the model");
+		return model;
+	}
+	// base gets frozen, and has to outlive the overlay: destroying it first
+	// trips the assert in ~Model (without NDEBUG) and leaks it. moving base
+	// to another Model is fine, the model underneath stays where it is
+	static Model overlay(Model &base, int mapsize = 8, uint32_t seed = 0)
+	{
+		return checked(ksh_overlaymodel(base.m, mapsize, nullptr, seed));
+	}
+
+	Model(const Model &) = delete;
+	Model &operator=(const Model &) = delete;
+	Model(Model &&other) noexcept : m(std::exchange(other.m, nullptr)) {}
+	Model &operator=(Model &&other) noexcept
+	{
+		if (this != &other) {
+			free();
+			m = std::exchange(other.m, nullptr);
+		}
+		return *this;
+	}
+	~Model() { free(); }
+
+	ksh_model_t *get() const noexcept { return m; }
+	ksh_model_t *release() noexcept { return std::exchange(m, nullptr); }
+	explicit operator bool() const noexcept { return m != nullptr; }
+	uint64_t rules() const noexcept { return m->frozen ? m->frozen->nrules : m->nrules; }
+	// copying is explicit, it can be a lot of memory
+	Model clone() const { return checked(ksh_clonemodel(m)); }
+
+	void train(std::string_view str, uint32_t weight = 1)
+	{
+		ksh_trainmarkov_len(m, str.data(), str.size(), weight);
+	}
+	// anything whose elements convert to std::string_view
+	template <class It>
+	void train(It first, It last, uint32_t weight = 1)
+	{
+		for (; first != last; ++first)
+			train(std::string_view(*first), weight);
+	}
+	template <class Range>
+	void train_all(const Range &strings, uint32_t weight = 1)
+	{
+		train(std::begin(strings), std::end(strings), weight);
+	}
+
+	// appends a string of at most maxbytes to out, so a string that gets
+	// cleared and reused keeps its capacity from one call to the next
+	std::string &generate(std::string &out, std::size_t maxbytes = 256)
+	{
+		std::size_t old = out.size();
+		out.resize(old + maxbytes);
+		// the terminating 0 may land on out[size()], which already is one
+		ksh_createstring(m, out.data() + old, maxbytes + 1);
+		out.resize(old + std::strlen(out.data() + old));
+		return out;
+	}
+	std::string generate(std::size_t maxbytes = 256)
+	{
+		std::string out;
+		generate(out, maxbytes);
+		return out;
+	}
+	// n strings, each followed by sep
+	std::string &generate_n(std::string &out, std::size_t n, char sep = '\n', std::size_t maxbytes = 256)
+	{
+		for (std::size_t i = 0; i < n; i++) {
+			generate(out, maxbytes);
+			out.push_back(sep);
+		}
+		return out;
+	}
+	// see ksh_createstring_at, needs set_rng(KSH_RNG_PHILOX, ...)
+	std::string &generate_at(std::string &out, uint32_t stream, uint64_t index, std::size_t maxbytes = 256)
+	{
+		std::size_t old = out.size();
+		out.resize(old + maxbytes);
+		if (ksh_createstring_at(m, stream, index, out.data() + old, maxbytes + 1) < 0) {
+			out.resize(old);
+			throw std::logic_error("koishi: generate_at needs the philox rng");
+		}
+		out.resize(old + std::strlen(out.data() + old));
+		return out;
+	}
+
+	// natural log of the probability of generating str
+	double score(std::string_view str)
+	{
+		const char *p = str.data();
+		std::size_t len = str.size();
+		double out;
+		ksh_scorestrings_len(m, &p, &len, 1, &out);
+		return out;
+	}
+	// scores the strings in batches on the stack, writing the results to out
+	template <class It, class OutIt>
+	OutIt score(It first, It last, OutIt out)
+	{
+		constexpr int batch = 64;
+		const char *ptrs[batch];
+		std::size_t lens[batch];
+		double res[batch];
+		while (first != last) {
+			int n = 0;
+			for (; n < batch && first != last; ++n, ++first) {
+				std::string_view str(*first);
+				ptrs[n] = str.data();
+				lens[n] = str.size();
+			}
+			ksh_scorestrings_len(m, ptrs, lens, n, res);
+			for (int i = 0; i < n; i++)
+				*out++ = res[i];
+		}
+		return out;
+	}
+	template <class Range, class OutIt>
+	OutIt score_all(const Range &strings, OutIt out)
+	{
+		return score(std::begin(strings), std::end(strings), out);
+	}
+
+	void set_rng(int engine, uint64_t seed) { check(ksh_setrng(m, engine, seed)); }
+	void reserve(uint64_t expected_rules) { check(ksh_reserve(m, expected_rules)); }
+	void freeze() { check(ksh_freezemodel(m)); }
+	void thaw() { check(ksh_thawmodel(m)); }
+	void save(std::FILE *f) { ksh_savemodel(m, f); }
+	void save_packed(std::FILE *f, bool compress = true) { check(ksh_savemodel_packed(m, f, compress)); }
+
+private:
+	ksh_model_t *m;
+
+	static Model checked(ksh_model_t *model)
+	{
+		if (!model)
+			throw std::bad_alloc();
+		return Model(model);
+	}
+	void free() noexcept
+	{
+		if (!m)
+			return;
+		int ret = ksh_freemodel(m);
+		assert(ret == 0 && "koishi: a model was destroyed before the overlays on it");
+		(void)ret;
+	}
+	static void check(int ret)
+	{
+		if (ret < 0)
+			throw std::runtime_error("koishi: operation failed");
+	}
+};
+
+} // namespace koishi
+
+#endif
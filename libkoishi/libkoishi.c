@@ -1,6 +1,19 @@
 #include "libkoishi.h"
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#ifndef KSH_NO_SIMD
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#endif
 
 #define RND_IMPLEMENTATION
 #define RND_U32 uint32_t
@@ -21,9 +34,352 @@ struct cont {
 	int i; // the index within ksh_continuations_t or ksh_rule_t, -1 if not found
 };
 
+// the built-in rng keeps a batch of raw 64-bit numbers around, so the
+// generator is run in a tight loop instead of once per character
+#define RNG_BATCH 64
+
+struct rngstate {
+	int engine;
+	union {
+		rnd_pcg_t pcg;
+		rnd_xorshift_t xorshift;
+		rnd_well_t well;
+		struct {
+			uint32_t key[2];
+			uint32_t ctr[4]; // block number, then whatever the caller puts above it
+		} philox;
+	} e;
+	int left; // numbers left unused in batch
+	uint64_t batch[RNG_BATCH];
+};
+
+// philox4x32-10 (salmon et al., "parallel random numbers: as easy as 1, 2, 3"):
+// a block of output is a keyed hash of a 128-bit counter, so any part of the
+// sequence can be got at directly without running through what comes before
+#define PHILOX_M0 0xD2511F53
+#define PHILOX_M1 0xCD9E8D57
+#define PHILOX_W0 0x9E3779B9
+#define PHILOX_W1 0xBB67AE85
+#define PHILOX_ROUNDS 10
+
+static inline void
+philox_block(const uint32_t *ctr, const uint32_t *key, uint32_t *out)
+{
+	uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+	uint32_t k0 = key[0], k1 = key[1];
+	for (int r = 0; r < PHILOX_ROUNDS; r++) {
+		uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+		uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+		c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+		c1 = (uint32_t)p1;
+		c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+		c3 = (uint32_t)p0;
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+	out[0] = c0;
+	out[1] = c1;
+	out[2] = c2;
+	out[3] = c3;
+}
+
+void
+rng_refill(struct rngstate *s)
+{
+	switch (s->engine) {
+	case KSH_RNG_PHILOX:
+		for (int i = 0; i < RNG_BATCH; i += 2) {
+			uint32_t out[4];
+			philox_block(s->e.philox.ctr, s->e.philox.key, out);
+			s->batch[i] = (uint64_t)out[0] << 32 | out[1];
+			s->batch[i+1] = (uint64_t)out[2] << 32 | out[3];
+			// the whole counter is one 128-bit number, so used on its own the sequence never repeats
+			for (int j = 0; j < 4 && ++s->e.philox.ctr[j] == 0; j++)
+				;
+		}
+		break;
+	case KSH_RNG_XORSHIFT:
+		for (int i = 0; i < RNG_BATCH; i++)
+			s->batch[i] = rnd_xorshift_next(&s->e.xorshift);
+		break;
+	case KSH_RNG_WELL:
+		for (int i = 0; i < RNG_BATCH; i++)
+			s->batch[i] = (uint64_t)rnd_well_next(&s->e.well) << 32 | rnd_well_next(&s->e.well);
+		break;
+	default:
+		for (int i = 0; i < RNG_BATCH; i++)
+			s->batch[i] = (uint64_t)rnd_pcg_next(&s->e.pcg) << 32 | rnd_pcg_next(&s->e.pcg);
+		break;
+	}
+	s->left = RNG_BATCH;
+}
+
+static inline uint64_t
+rng_next(struct rngstate *s)
+{
+	if (s->left == 0)
+		rng_refill(s);
+	return s->batch[--s->left];
+}
+
 int64_t
 defaultrng(void* rngdata, int64_t max) {
-	return (int64_t)(rnd_pcg_nextf((rnd_pcg_t*)rngdata) * max);
+	// lemire's multiply-shift: the high half of x*max is uniform in [0, max)
+	// after rejecting the few low halves that would make it biased
+	if (max <= 0)
+		return 0;
+	struct rngstate *s = rngdata;
+	uint64_t range = max;
+	unsigned __int128 m = (unsigned __int128)rng_next(s) * range;
+	if ((uint64_t)m < range) {
+		uint64_t threshold = -range % range;
+		while ((uint64_t)m < threshold)
+			m = (unsigned __int128)rng_next(s) * range;
+	}
+	return m >> 64;
+}
+
+int
+ksh_setrng(ksh_model_t *model, int engine, uint64_t seed)
+{
+	struct rngstate *s = model->rng == defaultrng ? model->rngdata : NULL;
+	if (!s) {
+		s = malloc(sizeof(struct rngstate));
+		if (!s)
+			return -1;
+	}
+	s->engine = engine;
+	switch (engine) {
+	case KSH_RNG_XORSHIFT:
+		rnd_xorshift_seed(&s->e.xorshift, seed);
+		break;
+	case KSH_RNG_WELL:
+		rnd_well_seed(&s->e.well, seed ^ seed >> 32);
+		break;
+	case KSH_RNG_PHILOX:
+		s->e.philox.key[0] = seed;
+		s->e.philox.key[1] = seed >> 32;
+		memset(s->e.philox.ctr, 0, sizeof(s->e.philox.ctr));
+		break;
+	default:
+		s->engine = KSH_RNG_PCG;
+		rnd_pcg_seed(&s->e.pcg, seed ^ seed >> 32);
+		break;
+	}
+	s->left = 0;
+	model->rng = defaultrng;
+	model->rngdata = s;
+	return 0;
+}
+
+/*
+ * placed memory: the hashmap, slabs and frozen form can be big enough for
+ * the tlb and numa placement to matter, so they're allocated according to
+ * the model's policy (see ksh_setalloc). without one it's just calloc, with
+ * one it's an anonymous mapping, madvised or from the hugetlb pool and then
+ * mbind-ed before it's touched. either way there's a header in front, so
+ * freeing doesn't have to know what the policy was back then
+ */
+#define PLACED_HEADER 64 // keeps what comes after it cache line aligned
+#define HUGEPAGE ((size_t)2<<20)
+// from linux/mempolicy.h, so libnuma isn't needed
+#define KSH_MPOL_PREFERRED 1
+#define KSH_MPOL_INTERLEAVE 3
+#define KSH_MPOL_F_MEMS_ALLOWED 4
+#define KSH_MAXNODES 1024
+
+struct placed {
+	void *map; // start of the mapping, NULL if it came from calloc
+	size_t maplen;
+};
+
+int
+numa_allowed(unsigned long *mask)
+{
+	// the nodes this process may allocate on, returns the highest one + 1
+	memset(mask, 0, KSH_MAXNODES/8);
+	int mode;
+	if (syscall(SYS_get_mempolicy, &mode, mask, KSH_MAXNODES, NULL, KSH_MPOL_F_MEMS_ALLOWED) < 0) {
+		mask[0] = 1;
+		return 1;
+	}
+	int n = 0;
+	for (int i = 0; i < KSH_MAXNODES; i++)
+		if (mask[i / (8*sizeof(long))] & (1UL << (i % (8*sizeof(long)))))
+			n = i+1;
+	return n ? n : 1;
+}
+
+char*
+placed_map(size_t len, int flags)
+{
+	// huge pages only make sense for allocations at least that big
+	if (len < HUGEPAGE)
+		flags &= ~(KSH_ALLOC_THP | KSH_ALLOC_HUGETLB);
+	char *map;
+	if (flags & KSH_ALLOC_HUGETLB) {
+		map = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if (map != MAP_FAILED)
+			return map;
+		flags |= KSH_ALLOC_THP; // the pool is empty or there's none, so try the transparent ones
+	}
+	if (!(flags & KSH_ALLOC_THP)) {
+		map = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		return map == MAP_FAILED ? NULL : map;
+	}
+	// transparent huge pages only back aligned 2 MiB ranges, so the mapping
+	// is made a bit bigger and the unaligned ends cut off
+	char *raw = mmap(NULL, len + HUGEPAGE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED)
+		return NULL;
+	map = (char*)(((uintptr_t)raw + HUGEPAGE-1) & ~(HUGEPAGE-1));
+	if (map > raw)
+		munmap(raw, map - raw);
+	munmap(map + len, raw + HUGEPAGE - map);
+	madvise(map, len, MADV_HUGEPAGE);
+	return map;
+}
+
+void*
+placed_alloc(size_t size, int flags, int node)
+{
+	// zeroed, like calloc
+	if (!flags) {
+		char *p = calloc(1, PLACED_HEADER + size);
+		if (!p)
+			return NULL;
+		((struct placed*)p)->map = NULL;
+		return p + PLACED_HEADER;
+	}
+	size_t len = PLACED_HEADER + size;
+	if (flags & (KSH_ALLOC_THP | KSH_ALLOC_HUGETLB) && len >= HUGEPAGE)
+		len = (len + HUGEPAGE-1) & ~(HUGEPAGE-1);
+	else
+		len = (len + 4095) & ~(size_t)4095;
+	char *map = placed_map(len, flags);
+	if (!map)
+		return NULL;
+	// nothing has been touched yet, so every page will be put where the policy says.
+	// it's only advice, if the kernel doesn't do numa the memory is still good
+	unsigned long mask[KSH_MAXNODES/(8*sizeof(long))];
+	if (flags & KSH_ALLOC_INTERLEAVE) {
+		int n = numa_allowed(mask);
+		syscall(SYS_mbind, map, len, KSH_MPOL_INTERLEAVE, mask, n+1, 0);
+	} else if (flags & KSH_ALLOC_NODE && node >= 0 && node < KSH_MAXNODES) {
+		memset(mask, 0, sizeof(mask));
+		mask[node / (8*sizeof(long))] = 1UL << (node % (8*sizeof(long)));
+		syscall(SYS_mbind, map, len, KSH_MPOL_PREFERRED, mask, node+2, 0);
+	}
+	((struct placed*)map)->map = map;
+	((struct placed*)map)->maplen = len;
+	return map + PLACED_HEADER;
+}
+
+void
+placed_free(void *ptr)
+{
+	if (!ptr)
+		return;
+	struct placed *hdr = (struct placed*)((char*)ptr - PLACED_HEADER);
+	if (hdr->map)
+		munmap(hdr->map, hdr->maplen);
+	else
+		free(hdr);
+}
+
+#define POOL_FIRSTSLAB 256
+#define POOL_MAXSLAB 65536
+
+void
+pool_init(ksh_pool_t *pool, size_t objsize)
+{
+	memset(pool, 0, sizeof(ksh_pool_t));
+	pool->objsize = objsize;
+	pool->slabobjs = POOL_FIRSTSLAB;
+}
+
+int
+pool_grow(ksh_pool_t *pool, size_t n)
+{
+	// the slab header is padded to 16 bytes to keep the objects aligned
+	char *slab = placed_alloc(16 + n*pool->objsize, pool->allocflags, pool->allocnode);
+	if (!slab)
+		return -1;
+	*(void**)slab = pool->slabs;
+	pool->slabs = slab;
+	pool->cur = slab + 16;
+	pool->end = pool->cur + n*pool->objsize;
+	return 0;
+}
+
+void*
+pool_alloc(ksh_pool_t *pool)
+{
+	if (pool->freelist) {
+		void *obj = pool->freelist;
+		pool->freelist = *(void**)obj;
+		memset(obj, 0, pool->objsize);
+		pool->live++;
+		return obj;
+	}
+	if (pool->cur == pool->end) {
+		if (pool_grow(pool, pool->slabobjs) < 0)
+			return NULL;
+		if (pool->slabobjs < POOL_MAXSLAB)
+			pool->slabobjs *= 2;
+	}
+	void *obj = pool->cur;
+	pool->cur += pool->objsize;
+	pool->live++;
+	return obj;
+}
+
+void
+pool_free(ksh_pool_t *pool, void *obj)
+{
+	*(void**)obj = pool->freelist;
+	pool->freelist = obj;
+	pool->live--;
+}
+
+int
+pool_reserve(ksh_pool_t *pool, size_t n)
+{
+	// make sure the next n allocations don't need another slab
+	size_t left = (pool->end - pool->cur) / pool->objsize;
+	if (left >= n)
+		return 0;
+	return pool_grow(pool, n);
+}
+
+void
+pool_adopt(ksh_pool_t *dst, ksh_pool_t *src)
+{
+	// moves all of src's slabs over to dst
+	if (!src->slabs)
+		return;
+	void **tail = src->slabs;
+	while (*tail)
+		tail = *tail;
+	*tail = dst->slabs;
+	dst->slabs = src->slabs;
+	dst->live += src->live;
+	pool_init(src, src->objsize);
+}
+
+void
+pool_destroy(ksh_pool_t *pool)
+{
+	void *slab = pool->slabs;
+	while (slab) {
+		void *next = *(void**)slab;
+		placed_free(slab);
+		slab = next;
+	}
+	int flags = pool->allocflags, node = pool->allocnode;
+	pool_init(pool, pool->objsize);
+	pool->allocflags = flags;
+	pool->allocnode = node;
 }
 
 ksh_model_t*
@@ -32,44 +388,154 @@ ksh_createmodel(int mapsize, int64_t (*rng)(void*, int64_t), uint32_t seed)
 	ksh_model_t *model = malloc(sizeof(ksh_model_t));
 	if (!model)
 		return NULL;
-	if (!rng) {
-		model->rng = defaultrng;
-		model->rngdata = malloc(sizeof(rnd_pcg_t));
-		rnd_pcg_seed(model->rngdata, seed);
-	} else {
-		model->rng = rng;
+	model->rng = rng;
+	model->rngdata = NULL;
+	if (!rng && ksh_setrng(model, KSH_RNG_PCG, seed) < 0) {
+		free(model);
+		return NULL;
 	}
 
 	model->mapsize = mapsize;
-	model->hashmap = calloc(sizeof(ksh_rule_t*), 1<<mapsize);
-	if (!model->hashmap)
+	model->frozen = NULL;
+	model->mapped = 0;
+	model->reach = NULL;
+	model->lazy = NULL;
+	model->genflags = 0;
+	model->seen = NULL;
+	model->bounded = 0;
+	model->maxbytes = 0;
+	model->halflife = 0;
+	model->sincedecay = 0;
+	model->epoch = 0;
+	model->clockhand = 0;
+	model->base = NULL;
+	model->overlays = 0;
+	model->allocflags = 0;
+	model->allocnode = 0;
+	model->nrules = 0;
+	pool_init(&model->rulepool, sizeof(ksh_rule_t));
+	pool_init(&model->contpool, sizeof(ksh_continuations_t));
+	model->hashmap = placed_alloc(sizeof(ksh_rule_t*) << mapsize, 0, 0);
+	if (!model->hashmap) {
+		if (model->rng == defaultrng)
+			free(model->rngdata);
+		free(model);
 		return NULL;
+	}
 	return model;
 }
 
+void frozen_release(ksh_model_t *model);
+// lazily opened models, see ksh_openmodel
+void lazy_close(ksh_model_t *model);
+void lazy_fault(ksh_model_t *model, uint32_t hash, int pin);
+int lazy_materialize(ksh_model_t *model);
+// bounded models, see ksh_setbounded
+#define RULE_REF 0x80000000
+#define RULE_EPOCH 0x7FFFFFFF
+ksh_rule_t *bounded_touch(ksh_model_t *model, ksh_rule_t **link);
+void bounded_sync(ksh_model_t *model, uint64_t b);
+// overlays, see ksh_overlaymodel
+int overlay_flatten(ksh_model_t *model);
+
+void
+free_rule(ksh_model_t *model, ksh_rule_t *rule)
+{
+	// gives a single rule, already unlinked from its bucket, back to the pools
+	ksh_continuations_t *cont = rule->cont;
+	while (cont != NULL) {
+		ksh_continuations_t *next = cont->next;
+		pool_free(&model->contpool, cont);
+		cont = next;
+	}
+	pool_free(&model->rulepool, rule);
+	model->nrules--;
+}
+
+void
+free_rules(ksh_model_t *model)
+{
+	pool_destroy(&model->rulepool);
+	pool_destroy(&model->contpool);
+	placed_free(model->hashmap);
+	model->hashmap = NULL;
+	model->nrules = 0;
+}
+
 void
+shadow_init(ksh_model_t *shadow, ksh_model_t *model)
+{
+	// a copy of the model for a thread that builds rules in its own part of the
+	// hashmap, out of pools of its own which get adopted once it's done
+	*shadow = *model;
+	shadow->nrules = 0;
+	pool_init(&shadow->rulepool, sizeof(ksh_rule_t));
+	pool_init(&shadow->contpool, sizeof(ksh_continuations_t));
+	shadow->rulepool.allocflags = shadow->contpool.allocflags = model->allocflags;
+	shadow->rulepool.allocnode = shadow->contpool.allocnode = model->allocnode;
+}
+
+int
+ksh_setalloc(ksh_model_t *model, int flags, int node)
+{
+	model->allocflags = flags;
+	model->allocnode = node;
+	model->rulepool.allocflags = model->contpool.allocflags = flags;
+	model->rulepool.allocnode = model->contpool.allocnode = node;
+	// the hashmap and frozen form get moved over, slabs that already exist stay where they are
+	if (model->hashmap) {
+		size_t size = sizeof(ksh_rule_t*) << model->mapsize;
+		ksh_rule_t **hashmap = placed_alloc(size, flags, node);
+		if (!hashmap)
+			return -1;
+		memcpy(hashmap, model->hashmap, size);
+		placed_free(model->hashmap);
+		model->hashmap = hashmap;
+	}
+	if (model->frozen && !model->mapped) {
+		ksh_frozen_t *fz = placed_alloc(model->frozen->size, flags, node);
+		if (!fz)
+			return -1;
+		memcpy(fz, model->frozen, model->frozen->size);
+		placed_free(model->frozen);
+		model->frozen = fz;
+	}
+	return 0;
+}
+
+int
+ksh_numa_nodes(void)
+{
+	unsigned long mask[KSH_MAXNODES/(8*sizeof(long))];
+	return numa_allowed(mask);
+}
+
+int
+ksh_numa_node(void)
+{
+	unsigned cpu, node;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+		return 0;
+	return node;
+}
+
+int
 ksh_freemodel(ksh_model_t *model)
 {
-	if (model->rng = defaultrng) {
+	if (__atomic_load_n(&model->overlays, __ATOMIC_RELAXED))
+		return -1; // they're still reading its frozen form
+	if (model->rng == defaultrng) {
 		free(model->rngdata);
 	}
-	for (uint64_t i = 0; i < (1<<model->mapsize); i++) {
-		ksh_rule_t *rule, *nextrule;
-		ksh_continuations_t *cont, *nextcont;
-		rule = model->hashmap[i];
-		while (rule != NULL) {
-			cont = rule->cont;
-			while (cont != NULL) {
-				nextcont = cont->next;
-				free(cont);
-				cont = nextcont;
-			}
-			nextrule = rule->next;
-			free(rule);
-			rule = nextrule;
-		}
-	}
+	if (model->lazy)
+		lazy_close(model);
+	if (model->base)
+		__atomic_sub_fetch(&model->base->overlays, 1, __ATOMIC_RELAXED);
+	free_rules(model);
+	frozen_release(model);
+	free(model->seen);
 	free(model);
+	return 0;
 }
 
 uint32_t
@@ -110,6 +576,21 @@ fnv_32a_folded(void *buf, size_t len, int foldto) {
 	return hash;
 }
 
+ksh_rule_t*
+find_rule(ksh_model_t *model, ksh_u32char *name, uint32_t hash) {
+	if (model->lazy)
+		lazy_fault(model, hash, 0);
+	ksh_rule_t **link = &model->hashmap[hash];
+	for(ksh_rule_t *rule = *link; rule != NULL; link = &rule->next, rule = rule->next) {
+		if (0 == memcmp(name, rule->name, 4*sizeof(ksh_u32char))) {
+			if (model->bounded)
+				return bounded_touch(model, link);
+			return rule;
+		}
+	}
+	return NULL;
+}
+
 ksh_rule_t*
 resolve_rule(ksh_model_t *model, ksh_u32char *name, uint32_t *hashptr) {
 	uint32_t hash = fnv_32a_folded(name, 4*sizeof(ksh_u32char), model->mapsize);
@@ -117,15 +598,7 @@ resolve_rule(ksh_model_t *model, ksh_u32char *name, uint32_t *hashptr) {
 	if (hashptr)
 		*hashptr = hash;
 	// optionally return the hash to the caller, for example to create a new rule under it
-	ksh_rule_t *rule = model->hashmap[hash];
-	if (!rule)
-		return NULL;
-	for(; rule != NULL; rule = rule->next) {
-		if (0 == memcmp(name, rule->name, 4*sizeof(ksh_u32char))) {
-			return rule;
-		}
-	}
-	return NULL;
+	return find_rule(model, name, hash);
 }
 
 ksh_rule_t*
@@ -136,25 +609,124 @@ create_rule(ksh_model_t *model, ksh_u32char *name, uint32_t *hashptr) {
 	} else {
 		hash = *hashptr;
 	}
-	ksh_rule_t *rule = calloc(1, sizeof(ksh_rule_t));
+	ksh_rule_t *rule = pool_alloc(&model->rulepool);
+	if (!rule)
+		return NULL;
 	memcpy(rule->name, name, 4*sizeof(ksh_u32char));
+	rule->stamp = model->epoch | RULE_REF;
 	rule->next = model->hashmap[hash];
 	model->hashmap[hash] = rule;
+	model->nrules++;
 	return rule;
 }
 
 ksh_rule_t*
-resolve_create_rule(ksh_model_t *model, ksh_u32char *name) {
-	uint32_t hash;
-	ksh_rule_t *rule = resolve_rule(model, name, &hash);
+find_create_rule(ksh_model_t *model, ksh_u32char *name, uint32_t hash) {
+	ksh_rule_t *rule = find_rule(model, name, hash);
+	if (model->lazy)
+		lazy_fault(model, hash, 1); // it's about to be changed, so keep it around
 	if (!rule)
 		rule = create_rule(model, name, &hash);
 	return rule;
 }
 
+ksh_rule_t*
+resolve_create_rule(ksh_model_t *model, ksh_u32char *name) {
+	uint32_t hash = fnv_32a_folded(name, 4*sizeof(ksh_u32char), model->mapsize);
+	return find_create_rule(model, name, hash);
+}
+
+/*
+ * continuation scans. the frozen form keeps every rule's continuations in
+ * contiguous arrays, and the continuation structs are exactly 4 wide, so both
+ * can be compared a whole vector at a time. avx2 gets used if the library is
+ * built with it enabled (-mavx2, -march=native), sse2 is always there on
+ * x86-64, and everything else (or -DKSH_NO_SIMD) gets the plain loops
+ */
+#if !defined(KSH_NO_SIMD) && defined(__SSE2__)
+#define KSH_SIMD 1
+#endif
+
+static inline uint32_t
+find_char(const ksh_u32char *chars, uint32_t n, ksh_u32char ch)
+{
+	// index of the first of n chars equal to ch, or n
+	uint32_t i = 0;
+#if defined(KSH_SIMD) && defined(__AVX2__)
+	__m256i needle8 = _mm256_set1_epi32(ch);
+	for (; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)&chars[i]);
+		int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, needle8)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+#ifdef KSH_SIMD
+	__m128i needle4 = _mm_set1_epi32(ch);
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*)&chars[i]);
+		int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, needle4)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i < n; i++) {
+		if (chars[i] == ch)
+			return i;
+	}
+	return n;
+}
+
+static inline uint32_t
+find_threshold(const uint32_t *probs, uint32_t n, int64_t *r, int64_t total)
+{
+	// index of the first of n probabilities where the running sum goes past *r.
+	// if there's none, n is returned and the sum of all of them is taken off *r.
+	// the vector paths need every running sum of the rule (so up to total) to fit in an int32
+	uint32_t i = 0;
+#ifdef KSH_SIMD
+	if (total < INT32_MAX) {
+		int32_t base = 0; // sum of everything before i
+#ifdef __AVX2__
+		__m256i r8 = _mm256_set1_epi32(*r);
+		for (; i + 8 <= n; i += 8) {
+			__m256i v = _mm256_loadu_si256((const __m256i*)&probs[i]);
+			// running sum within each 128-bit half, then carry the low half's total over
+			v = _mm256_add_epi32(v, _mm256_slli_si256(v, 4));
+			v = _mm256_add_epi32(v, _mm256_slli_si256(v, 8));
+			v = _mm256_add_epi32(v, _mm256_shuffle_epi32(_mm256_permute2x128_si256(v, v, 0x08), 0xFF));
+			v = _mm256_add_epi32(v, _mm256_set1_epi32(base));
+			int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, r8)));
+			if (mask)
+				return i + __builtin_ctz(mask);
+			base = _mm256_extract_epi32(v, 7);
+		}
+#endif
+		__m128i r4 = _mm_set1_epi32(*r);
+		for (; i + 4 <= n; i += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i*)&probs[i]);
+			v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+			v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+			v = _mm_add_epi32(v, _mm_set1_epi32(base));
+			int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, r4)));
+			if (mask)
+				return i + __builtin_ctz(mask);
+			base = _mm_cvtsi128_si32(_mm_shuffle_epi32(v, 0xFF));
+		}
+		*r -= base;
+	}
+#endif
+	for (; i < n; i++) {
+		*r -= probs[i];
+		if (*r < 0)
+			return i;
+	}
+	return n;
+}
+
 struct cont
-resolve_create_cont(ksh_rule_t *rule, ksh_u32char ch) {
-	// oh wow this function is horrible
+resolve_create_cont(ksh_model_t *model, ksh_rule_t *rule, ksh_u32char ch) {
+	// oh wow this function is horrible. i is -1 if there's no memory for it
 	struct cont ret;
 	ksh_continuations_t *lastobj;
 	for (int i = 0; i < KSH_CONTINUATIONS_PER_HEADER; i++) {
@@ -166,12 +738,11 @@ resolve_create_cont(ksh_rule_t *rule, ksh_u32char ch) {
 	}
 	for(ksh_continuations_t *c = rule->cont; c != NULL; c = c->next) {
 		lastobj = c;
-		for (int i = 0; i < KSH_CONTINUATIONS_PER_STRUCT; i++) {
-			if (c->character[i] == ch) {
-				ret.ptr = c;
-				ret.i = i;
-				return ret;
-			}
+		int i = find_char(c->character, KSH_CONTINUATIONS_PER_STRUCT, ch);
+		if (i < KSH_CONTINUATIONS_PER_STRUCT) {
+			ret.ptr = c;
+			ret.i = i;
+			return ret;
 		}
 	}
 	// not found, create
@@ -186,7 +757,12 @@ resolve_create_cont(ksh_rule_t *rule, ksh_u32char ch) {
 			}
 		}
 		// no empty space in object, create new
-		ksh_continuations_t *new = calloc(1, sizeof(ksh_continuations_t));
+		ksh_continuations_t *new = pool_alloc(&model->contpool);
+		if (!new) {
+			ret.ptr = NULL;
+			ret.i = -1;
+			return ret;
+		}
 		new->character[0] = ch;
 		lastobj->next = new;
 		ret.ptr = new;
@@ -203,7 +779,12 @@ resolve_create_cont(ksh_rule_t *rule, ksh_u32char ch) {
 			}
 		}
 		// no empty space in object, create new
-		ksh_continuations_t *new = calloc(1, sizeof(ksh_continuations_t));
+		ksh_continuations_t *new = pool_alloc(&model->contpool);
+		if (!new) {
+			ret.ptr = NULL;
+			ret.i = -1;
+			return ret;
+		}
 		new->character[0] = ch;
 		rule->cont = new;
 		ret.ptr = new;
@@ -212,90 +793,552 @@ resolve_create_cont(ksh_rule_t *rule, ksh_u32char ch) {
 	}
 }
 
-void
-append_cont(ksh_rule_t *rule, struct cont *ctx)
+int
+append_cont(ksh_model_t *model, ksh_rule_t *rule, struct cont *ctx)
 {
 	ctx->i++;
 	if (!ctx->ptr) {
 		if (ctx->i >= KSH_CONTINUATIONS_PER_HEADER) {
-			ksh_continuations_t *new = calloc(1, sizeof(ksh_continuations_t));
+			ksh_continuations_t *new = pool_alloc(&model->contpool);
+			if (!new)
+				return -1;
 			rule->cont = new;
 			ctx->ptr = new;
 			ctx->i = 0;
 		}
 	} else {
 		if (ctx->i >= KSH_CONTINUATIONS_PER_STRUCT) {
-			ksh_continuations_t *new = calloc(1, sizeof(ksh_continuations_t));
+			ksh_continuations_t *new = pool_alloc(&model->contpool);
+			if (!new)
+				return -1;
 			ctx->ptr->next = new;
 			ctx->ptr = new;
 			ctx->i = 0;
 		}
 	}
+	return 0;
 }
 
-void
-ksh_makeassociation(
-	ksh_model_t *model,
-	ksh_u32char *name,
-	ksh_u32char ch
-)
+#define FROZEN_BUCKETS(_FZ) ((uint32_t*)((char*)(_FZ) + (_FZ)->bucketoff))
+#define FROZEN_RULES(_FZ) ((ksh_frozenrule_t*)((char*)(_FZ) + (_FZ)->ruleoff))
+#define FROZEN_CHARS(_FZ) ((ksh_u32char*)((char*)(_FZ) + (_FZ)->charoff))
+#define FROZEN_PROBS(_FZ) ((uint32_t*)((char*)(_FZ) + (_FZ)->proboff))
+#define FROZEN_LINKS(_FZ) ((uint32_t*)((char*)(_FZ) + (_FZ)->linkoff))
+
+uint32_t
+frozen_find(ksh_frozen_t *fz, ksh_u32char *name)
 {
-	ksh_rule_t *rule = resolve_create_rule(model, name);
-	rule->probtotal++;
-	struct cont c = resolve_create_cont(rule, ch);
-	if (c.ptr) {
-		c.ptr->probability[c.i]++;
-	} else {
-		rule->probability[c.i]++;
+	// returns the index of the rule, or KSH_NOLINK
+	uint32_t hash = fnv_32a_folded(name, 4*sizeof(ksh_u32char), fz->mapsize);
+	uint32_t *buckets = FROZEN_BUCKETS(fz);
+	ksh_frozenrule_t *rules = FROZEN_RULES(fz);
+	for (uint32_t i = buckets[hash]; i < buckets[hash+1]; i++) {
+		if (0 == memcmp(name, rules[i].name, 4*sizeof(ksh_u32char)))
+			return i;
 	}
+	return KSH_NOLINK;
 }
 
-ksh_u32char
-ksh_getcontinuation(
-	ksh_model_t *model,
-	ksh_u32char *name
-)
+static inline ksh_frozenrule_t*
+overlay_find(ksh_model_t *model, ksh_u32char *name)
 {
-	ksh_rule_t *rule = resolve_rule(model, name, NULL);
-	if (!rule)
-		return 0;
-	int64_t r = model->rng(model->rngdata, rule->probtotal+1);
-	for (int i = 0; i < KSH_CONTINUATIONS_PER_HEADER; i++) {
-		Df("[get] Rrng%ld/%ld rx%02x(%c) p%u", r, rule->probtotal, rule->character[i], rule->character[i], rule->probability[i]);
-		r -= rule->probability[i];
-		if (r <= 0)
-			return rule->character[i];
+	// the base's rule of that name, if the model is an overlay
+	if (!model->base)
+		return NULL;
+	ksh_frozen_t *fz = model->base->frozen;
+	uint32_t i = frozen_find(fz, name);
+	return i == KSH_NOLINK ? NULL : &FROZEN_RULES(fz)[i];
+}
+
+uint32_t
+frozen_pick(ksh_frozen_t *fz, uint32_t ruleidx, int64_t (*rng)(void*, int64_t), void *rngdata)
+{
+	// returns the index of a random continuation of the rule, or KSH_NOLINK
+	ksh_frozenrule_t *rule = &FROZEN_RULES(fz)[ruleidx];
+	uint32_t *probs = FROZEN_PROBS(fz);
+	int64_t r = rng(rngdata, rule->probtotal);
+	uint32_t i = find_threshold(&probs[rule->first], rule->count, &r, rule->probtotal);
+	return i < rule->count ? rule->first + i : KSH_NOLINK;
+}
+
+ksh_frozen_t*
+frozen_build(ksh_model_t *model, int links)
+{
+	// builds the frozen form without touching the model. without links it
+	// stops at linkoff, which is all that saving needs
+	if (model->lazy && lazy_materialize(model) < 0)
+		return NULL;
+	uint64_t nbuckets = 1<<model->mapsize;
+	uint64_t nrules = 0, nconts = 0;
+	for (uint64_t i = 0; i < nbuckets; i++) {
+		if (model->bounded)
+			bounded_sync(model, i);
+		for (ksh_rule_t *rule = model->hashmap[i]; rule != NULL; rule = rule->next) {
+			nrules++;
+			for (int j = 0; j < KSH_CONTINUATIONS_PER_HEADER; j++)
+				if (rule->probability[j])
+					nconts++;
+			for (ksh_continuations_t *c = rule->cont; c != NULL; c = c->next)
+				for (int j = 0; j < KSH_CONTINUATIONS_PER_STRUCT; j++)
+					if (c->probability[j])
+						nconts++;
+		}
 	}
-	for(ksh_continuations_t *c = rule->cont; c != NULL; c = c->next) {
-		for (int i = 0; i < KSH_CONTINUATIONS_PER_STRUCT; i++) {
-			Df("[get] Crng%ld/%ld rx%02x(%c) p%u", r, rule->probtotal, c->character[i], c->character[i], c->probability[i]);
-			r -= c->probability[i];
-			if (r <= 0)
-				return c->character[i];
+	if (nrules >= KSH_NOLINK || nconts >= KSH_NOLINK)
+		return NULL; // indices wouldn't fit
+	// lay everything out one after the other, the header and rules need 8-byte alignment
+	ksh_frozen_t hdr = {0};
+	memcpy(hdr.magic, "l\x05\x01\x04", 4);
+	hdr.version = KSH_FROZEN_VERSION;
+	hdr.mapsize = model->mapsize;
+	hdr.nrules = nrules;
+	hdr.nconts = nconts;
+	hdr.ruleoff = sizeof(ksh_frozen_t);
+	hdr.bucketoff = hdr.ruleoff + nrules*sizeof(ksh_frozenrule_t);
+	hdr.charoff = hdr.bucketoff + (nbuckets+1)*sizeof(uint32_t);
+	hdr.proboff = hdr.charoff + nconts*sizeof(ksh_u32char);
+	hdr.linkoff = hdr.proboff + nconts*sizeof(uint32_t);
+	hdr.size = hdr.linkoff + (links ? nconts*sizeof(uint32_t) : 0);
+	ksh_frozen_t *fz = placed_alloc(hdr.size, model->allocflags, model->allocnode);
+	if (!fz)
+		return NULL;
+	*fz = hdr;
+
+	uint32_t *buckets = FROZEN_BUCKETS(fz);
+	ksh_frozenrule_t *rules = FROZEN_RULES(fz);
+	ksh_u32char *chars = FROZEN_CHARS(fz);
+	uint32_t *probs = FROZEN_PROBS(fz);
+	uint32_t r = 0, c = 0;
+	for (uint64_t i = 0; i < nbuckets; i++) {
+		buckets[i] = r;
+		for (ksh_rule_t *rule = model->hashmap[i]; rule != NULL; rule = rule->next) {
+			memcpy(rules[r].name, rule->name, 4*sizeof(ksh_u32char));
+			rules[r].probtotal = rule->probtotal;
+			rules[r].first = c;
+			for (int j = 0; j < KSH_CONTINUATIONS_PER_HEADER; j++) {
+				if (rule->probability[j]) {
+					chars[c] = rule->character[j];
+					probs[c++] = rule->probability[j];
+				}
+			}
+			for (ksh_continuations_t *cont = rule->cont; cont != NULL; cont = cont->next) {
+				for (int j = 0; j < KSH_CONTINUATIONS_PER_STRUCT; j++) {
+					if (cont->probability[j]) {
+						chars[c] = cont->character[j];
+						probs[c++] = cont->probability[j];
+					}
+				}
+			}
+			rules[r].count = c - rules[r].first;
+			r++;
 		}
 	}
-	return 0;
+	buckets[nbuckets] = r;
+	if (!links)
+		return fz;
+
+	// now that every rule has its place, link the continuations up
+	for (uint32_t i = 0; i < fz->nrules; i++) {
+		ksh_u32char next[4];
+		memcpy(next, &rules[i].name[1], 3*sizeof(ksh_u32char));
+		for (uint32_t j = rules[i].first; j < rules[i].first + rules[i].count; j++) {
+			if (chars[j] == 0) {
+				FROZEN_LINKS(fz)[j] = KSH_NOLINK; // string ends here
+				continue;
+			}
+			next[3] = chars[j];
+			FROZEN_LINKS(fz)[j] = frozen_find(fz, next);
+		}
+	}
+	return fz;
 }
 
-/*
- * rfc3629 for reference:
- * Char. number range  |        UTF-8 octet sequence
- *    (hexadecimal)    |              (binary)
- * --------------------+--------------------------------------
- * 0000 0000-0000 007F | 0xxxxxxx
- * 0000 0080-0000 07FF | 110xxxxx 10xxxxxx
- * 0000 0800-0000 FFFF | 1110xxxx 10xxxxxx 10xxxxxx
- * 0001 0000-0010 FFFF | 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx
- */
+void
+frozen_release(ksh_model_t *model)
+{
+	if (!model->frozen)
+		return;
+	if (model->mapped)
+		munmap(model->frozen, model->frozen->size);
+	else
+		placed_free(model->frozen);
+	model->frozen = NULL;
+	model->mapped = 0;
+	free(model->reach);
+	model->reach = NULL;
+}
 
 int
-utf8_readcharacter(ksh_u32char *out, const char *str)
+ksh_freezemodel(ksh_model_t *model)
 {
-	#define UTF8_VERIFY_TOP_BITS(UP_TO) \
-		for (int _VERIFY_I = 1; _VERIFY_I < UP_TO; _VERIFY_I++) \
-			if ((str[_VERIFY_I] & 0xC0) != 0x80) return -1;
-	ksh_u32char ch;
-	int bytesread = 0;
+	if (model->frozen)
+		return 0;
+	if (model->base && overlay_flatten(model) < 0)
+		return -1;
+	ksh_frozen_t *fz = frozen_build(model, 1);
+	if (!fz)
+		return -1;
+	free_rules(model);
+	model->frozen = fz;
+	return 0;
+}
+
+int
+thaw_into(ksh_model_t *model, ksh_frozen_t *fz)
+{
+	// rebuilds the rules of fz in model, which has no hashmap at this point
+	model->mapsize = fz->mapsize;
+	model->hashmap = placed_alloc(sizeof(ksh_rule_t*) << model->mapsize, model->allocflags, model->allocnode);
+	if (!model->hashmap)
+		return -1;
+	ksh_frozenrule_t *rules = FROZEN_RULES(fz);
+	ksh_u32char *chars = FROZEN_CHARS(fz);
+	uint32_t *probs = FROZEN_PROBS(fz);
+	// we know exactly how much memory this is going to take
+	uint64_t nblocks = 0;
+	for (uint32_t i = 0; i < fz->nrules; i++) {
+		if (rules[i].count > KSH_CONTINUATIONS_PER_HEADER)
+			nblocks += (rules[i].count - KSH_CONTINUATIONS_PER_HEADER + KSH_CONTINUATIONS_PER_STRUCT-1) / KSH_CONTINUATIONS_PER_STRUCT;
+	}
+	if (pool_reserve(&model->rulepool, fz->nrules) < 0 || pool_reserve(&model->contpool, nblocks) < 0)
+		return -1;
+	for (uint32_t i = 0; i < fz->nrules; i++) {
+		ksh_rule_t *rule = create_rule(model, rules[i].name, NULL);
+		if (!rule)
+			return -1;
+		rule->probtotal = rules[i].probtotal;
+		struct cont c = {.ptr=0, .i=-1};
+		for (uint32_t j = rules[i].first; j < rules[i].first + rules[i].count; j++) {
+			if (append_cont(model, rule, &c) < 0)
+				return -1;
+			if (c.ptr) {
+				c.ptr->character[c.i] = chars[j];
+				c.ptr->probability[c.i] = probs[j];
+			} else {
+				rule->character[c.i] = chars[j];
+				rule->probability[c.i] = probs[j];
+			}
+		}
+	}
+	return 0;
+}
+
+int
+ksh_thawmodel(ksh_model_t *model)
+{
+	if (!model->frozen)
+		return 0;
+	if (__atomic_load_n(&model->overlays, __ATOMIC_RELAXED))
+		return -1; // they're reading the frozen form
+	if (thaw_into(model, model->frozen) < 0)
+		return -1;
+	frozen_release(model);
+	return 0;
+}
+
+ksh_model_t*
+thawed_copy(ksh_model_t *model)
+{
+	// a throwaway copy of a frozen model with ordinary rules, for building
+	// something out of them without thawing the model itself, which may be
+	// mapped or have overlays
+	ksh_model_t *copy = ksh_createmodel(0, NULL, 0);
+	if (!copy)
+		return NULL;
+	free_rules(copy);
+	if (thaw_into(copy, model->frozen) < 0) {
+		ksh_freemodel(copy);
+		return NULL;
+	}
+	return copy;
+}
+
+int
+ksh_exportmodel(ksh_model_t *model, int fd)
+{
+	ksh_frozen_t *fz = model->frozen;
+	if (!fz && model->base)
+		return -1; // it would be missing everything from the base
+	if (!fz)
+		fz = frozen_build(model, 1);
+	if (!fz)
+		return -1;
+	int ret = 0;
+	char *p = (char*)fz;
+	uint64_t left = fz->size;
+	while (left > 0) {
+		ssize_t n = write(fd, p, left);
+		if (n <= 0) {
+			ret = -1;
+			break;
+		}
+		p += n;
+		left -= n;
+	}
+	if (fz != model->frozen)
+		placed_free(fz);
+	return ret;
+}
+
+ksh_model_t*
+ksh_mapmodel(int fd, int64_t (*rng)(void*, int64_t), uint32_t seed)
+{
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(ksh_frozen_t))
+		return NULL;
+	ksh_frozen_t *fz = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (fz == MAP_FAILED)
+		return NULL;
+	// only the header is checked, the rest is trusted to be what ksh_exportmodel wrote
+	if (memcmp(fz->magic, "l\x05\x01\x04", 4) || fz->version != KSH_FROZEN_VERSION
+			|| fz->size != st.st_size || fz->mapsize > 30
+			|| fz->linkoff + fz->nconts*sizeof(uint32_t) > fz->size) {
+		munmap(fz, st.st_size);
+		return NULL;
+	}
+	// the hashmap would only be thrown away, so it's made as small as it gets
+	ksh_model_t *model = ksh_createmodel(0, rng, seed);
+	if (!model) {
+		munmap(fz, st.st_size);
+		return NULL;
+	}
+	free_rules(model);
+	model->mapsize = fz->mapsize;
+	model->frozen = fz;
+	model->mapped = 1;
+	return model;
+}
+
+ksh_model_t*
+clone_placed(ksh_model_t *model, int allocflags, int allocnode)
+{
+	if (model->lazy && lazy_materialize(model) < 0)
+		return NULL;
+	// a frozen model doesn't need a hashmap, so it isn't made big only to be
+	// moved by ksh_setalloc and thrown away
+	ksh_model_t *clone = ksh_createmodel(model->frozen ? 0 : model->mapsize, model->rng == defaultrng ? NULL : model->rng, 0);
+	if (!clone)
+		return NULL;
+	if (model->frozen) {
+		free_rules(clone);
+		clone->mapsize = model->mapsize;
+	}
+	if (ksh_setalloc(clone, allocflags, allocnode) < 0)
+		goto clone_fail;
+	if (model->rng == defaultrng)
+		memcpy(clone->rngdata, model->rngdata, sizeof(struct rngstate));
+	else
+		clone->rngdata = model->rngdata;
+	clone->genflags = model->genflags;
+	clone->base = model->base;
+	if (clone->base)
+		__atomic_add_fetch(&clone->base->overlays, 1, __ATOMIC_RELAXED);
+	clone->bounded = model->bounded;
+	clone->maxbytes = model->maxbytes;
+	clone->halflife = model->halflife;
+	clone->sincedecay = model->sincedecay;
+	clone->epoch = model->epoch;
+	clone->clockhand = model->clockhand;
+	if (model->seen) {
+		clone->seen = malloc(model->seenbits/8);
+		if (!clone->seen)
+			goto clone_fail;
+		memcpy(clone->seen, model->seen, model->seenbits/8);
+		clone->seenbits = model->seenbits;
+		clone->seenhashes = model->seenhashes;
+	}
+	if (model->frozen) {
+		// no pointers in it, so copying the block is all there is to it
+		clone->frozen = placed_alloc(model->frozen->size, clone->allocflags, clone->allocnode);
+		if (!clone->frozen)
+			goto clone_fail;
+		memcpy(clone->frozen, model->frozen, model->frozen->size);
+		return clone;
+	}
+	// everything gets carved out of one slab per pool, in the order it's walked
+	if (pool_reserve(&clone->rulepool, model->rulepool.live) < 0
+			|| pool_reserve(&clone->contpool, model->contpool.live) < 0)
+		goto clone_fail;
+	for (uint64_t b = 0; b < ((uint64_t)1 << model->mapsize); b++) {
+		ksh_rule_t **tail = &clone->hashmap[b];
+		for (ksh_rule_t *rule = model->hashmap[b]; rule != NULL; rule = rule->next) {
+			ksh_rule_t *copy = pool_alloc(&clone->rulepool);
+			if (!copy)
+				goto clone_fail;
+			memcpy(copy, rule, sizeof(ksh_rule_t));
+			*tail = copy;
+			tail = &copy->next;
+			ksh_continuations_t **ctail = &copy->cont;
+			for (ksh_continuations_t *c = rule->cont; c != NULL; c = c->next) {
+				ksh_continuations_t *ccopy = pool_alloc(&clone->contpool);
+				if (!ccopy) {
+					*ctail = NULL;
+					*tail = NULL;
+					goto clone_fail;
+				}
+				memcpy(ccopy, c, sizeof(ksh_continuations_t));
+				*ctail = ccopy;
+				ctail = &ccopy->next;
+			}
+			*ctail = NULL;
+			clone->nrules++;
+		}
+		*tail = NULL;
+	}
+	return clone;
+clone_fail:
+	ksh_freemodel(clone);
+	return NULL;
+}
+
+ksh_model_t*
+ksh_clonemodel(ksh_model_t *model)
+{
+	return clone_placed(model, model->allocflags, model->allocnode);
+}
+
+ksh_model_t*
+ksh_replicamodel(ksh_model_t *model, int node)
+{
+	if (!model->frozen && ksh_freezemodel(model) < 0)
+		return NULL;
+	int flags = (model->allocflags & ~KSH_ALLOC_INTERLEAVE) | KSH_ALLOC_NODE;
+	return clone_placed(model, flags, node);
+}
+
+ksh_model_t*
+ksh_overlaymodel(ksh_model_t *base, int mapsize, int64_t (*rng)(void*, int64_t), uint32_t seed)
+{
+	// lookups go to the frozen form of the base, which never changes
+	if (!base->frozen && ksh_freezemodel(base) < 0)
+		return NULL;
+	ksh_model_t *model = ksh_createmodel(mapsize, rng, seed);
+	if (!model)
+		return NULL;
+	model->base = base;
+	__atomic_add_fetch(&base->overlays, 1, __ATOMIC_RELAXED);
+	return model;
+}
+
+int
+associate(ksh_model_t *model, ksh_rule_t *rule, ksh_u32char ch, uint32_t weight)
+{
+	// rule is NULL if it couldn't be created, then this fails too
+	if (!rule)
+		return -1;
+	if (weight == 0)
+		return 0; // a continuation with 0 probability would look like an empty slot
+	struct cont c = resolve_create_cont(model, rule, ch);
+	if (c.i < 0)
+		return -1;
+	uint32_t *prob = c.ptr ? &c.ptr->probability[c.i] : &rule->probability[c.i];
+	// counts stop at UINT32_MAX instead of wrapping around, the total only gets what was added
+	if (*prob > UINT32_MAX - weight)
+		weight = UINT32_MAX - *prob;
+	*prob += weight;
+	rule->probtotal += weight;
+	return 0;
+}
+
+void
+ksh_makeassociation(
+	ksh_model_t *model,
+	ksh_u32char *name,
+	ksh_u32char ch
+)
+{
+	if (model->frozen && ksh_thawmodel(model) < 0)
+		return;
+	associate(model, resolve_create_rule(model, name), ch, 1);
+}
+
+int
+overlay_flatten(ksh_model_t *model)
+{
+	// adds the base's counts to the overlay's own, after that it doesn't need the base
+	ksh_frozen_t *fz = model->base->frozen;
+	ksh_frozenrule_t *rules = FROZEN_RULES(fz);
+	ksh_u32char *chars = FROZEN_CHARS(fz);
+	uint32_t *probs = FROZEN_PROBS(fz);
+	if (ksh_reserve(model, model->nrules + fz->nrules) < 0)
+		return -1;
+	for (uint32_t i = 0; i < fz->nrules; i++) {
+		ksh_rule_t *rule = resolve_create_rule(model, rules[i].name);
+		if (!rule)
+			return -1;
+		for (uint32_t j = rules[i].first; j < rules[i].first + rules[i].count; j++) {
+			if (associate(model, rule, chars[j], probs[j]) < 0)
+				return -1;
+		}
+	}
+	__atomic_sub_fetch(&model->base->overlays, 1, __ATOMIC_RELAXED);
+	model->base = NULL;
+	return 0;
+}
+
+ksh_u32char
+ksh_getcontinuation(
+	ksh_model_t *model,
+	ksh_u32char *name
+)
+{
+	if (model->frozen) {
+		ksh_frozen_t *fz = model->frozen;
+		uint32_t rule = frozen_find(fz, name);
+		if (rule == KSH_NOLINK)
+			return 0;
+		uint32_t c = frozen_pick(fz, rule, model->rng, model->rngdata);
+		return c == KSH_NOLINK ? 0 : FROZEN_CHARS(fz)[c];
+	}
+	ksh_rule_t *rule = resolve_rule(model, name, NULL);
+	ksh_frozenrule_t *under = overlay_find(model, name);
+	if (!rule && !under)
+		return 0;
+	int64_t total = (rule ? rule->probtotal : 0) + (under ? under->probtotal : 0);
+	int64_t r = model->rng(model->rngdata, total);
+	if (under) {
+		// the base's continuations come first, then the overlay's own
+		ksh_frozen_t *fz = model->base->frozen;
+		uint32_t i = find_threshold(&FROZEN_PROBS(fz)[under->first], under->count, &r, total);
+		if (i < under->count)
+			return FROZEN_CHARS(fz)[under->first + i];
+		if (!rule)
+			return 0;
+	}
+	for (int i = 0; i < KSH_CONTINUATIONS_PER_HEADER; i++) {
+		Df("[get] Rrng%ld/%ld rx%02x(%c) p%u", r, rule->probtotal, rule->character[i], rule->character[i], rule->probability[i]);
+		r -= rule->probability[i];
+		if (r < 0)
+			return rule->character[i];
+	}
+	for(ksh_continuations_t *c = rule->cont; c != NULL; c = c->next) {
+		Df("[get] Crng%ld/%ld rx%02x(%c)...", r, rule->probtotal, c->character[0], c->character[0]);
+		int i = find_threshold(c->probability, KSH_CONTINUATIONS_PER_STRUCT, &r, total);
+		if (i < KSH_CONTINUATIONS_PER_STRUCT)
+			return c->character[i];
+	}
+	return 0;
+}
+
+/*
+ * rfc3629 for reference:
+ * Char. number range  |        UTF-8 octet sequence
+ *    (hexadecimal)    |              (binary)
+ * --------------------+--------------------------------------
+ * 0000 0000-0000 007F | 0xxxxxxx
+ * 0000 0080-0000 07FF | 110xxxxx 10xxxxxx
+ * 0000 0800-0000 FFFF | 1110xxxx 10xxxxxx 10xxxxxx
+ * 0001 0000-0010 FFFF | 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx
+ */
+
+int
+utf8_readcharacter(ksh_u32char *out, const char *str)
+{
+	#define UTF8_VERIFY_TOP_BITS(UP_TO) \
+		for (int _VERIFY_I = 1; _VERIFY_I < UP_TO; _VERIFY_I++) \
+			if ((str[_VERIFY_I] & 0xC0) != 0x80) return -1;
+	ksh_u32char ch;
+	int bytesread = 0;
 	if (!(str[0] & 0x80)) { // high bit not set, ascii
 		bytesread = 1;
 		ch = str[0];
@@ -331,6 +1374,18 @@ utf8_readcharacter(ksh_u32char *out, const char *str)
 	return bytesread;
 }
 
+static inline int
+utf8_readcharacter_len(ksh_u32char *out, const char *str, size_t left)
+{
+	// same, for strings that don't have to be 0-terminated. near the end the
+	// rest gets copied out and padded with zeros, which no sequence continues with
+	if (left >= 4)
+		return utf8_readcharacter(out, str);
+	char tail[4] = {0};
+	memcpy(tail, str, left);
+	return utf8_readcharacter(out, tail);
+}
+
 int
 utf8_writecharacter(ksh_u32char ch, char *buf) {
 	if (ch < 0x80) {
@@ -354,142 +1409,3128 @@ utf8_writecharacter(ksh_u32char ch, char *buf) {
 	}
 }
 
-void
-ksh_trainmarkov(ksh_model_t *model, const char *str)
+// a single step of a string, as queued up by training and scoring
+struct transition {
+	ksh_u32char name[4];
+	ksh_u32char ch;
+	uint32_t hash;
+	size_t string; // which one it's from
+};
+
+// strings are identified by a 64-bit fnv-1a of their codepoints
+#define RECORD_HASH_INIT 0xcbf29ce484222325
+#define RECORD_HASH_STEP(_H, _CH) (((_H) ^ (_CH)) * 0x100000001b3)
+
+struct decoder {
+	const char *str;
+	size_t len, i;
+	ksh_u32char name[4];
+	uint64_t hash; // the record hash, once it's done
+	int done;
+};
+
+static inline void
+decoder_init(struct decoder *d, const char *str, size_t len)
 {
-	ksh_u32char buf[4] = {0};
-	ksh_u32char ch = 0;
-	int i = 0;
-	while (str[i] != 0) {
-		int len = utf8_readcharacter(&ch, &str[i]);
-		if (len < 0) { // skip over invalid characters i dont care
+	d->str = str;
+	d->len = len;
+	d->i = 0;
+	memset(d->name, 0, sizeof(d->name));
+	d->hash = RECORD_HASH_INIT;
+	d->done = 0;
+}
+
+static inline int
+decoder_next(struct decoder *d, struct transition *t, int mapsize)
+{
+	// the next transition a string is trained on, with the bucket of its rule.
+	// returns 0 after the one that ends the string
+	if (d->done)
+		return 0;
+	ksh_u32char ch;
+	while (1) {
+		if (d->i >= d->len || d->str[d->i] == 0) {
+			// after the string has been studied, teach to end on it
+			ch = 0;
+			break;
+		}
+		int clen = utf8_readcharacter_len(&ch, &d->str[d->i], d->len - d->i);
+		if (clen < 0) { // skip over invalid characters i dont care
+			d->i++;
+			continue;
+		}
+		d->i += clen;
+		d->hash = RECORD_HASH_STEP(d->hash, ch);
+		break;
+	}
+	memcpy(t->name, d->name, 4*sizeof(ksh_u32char));
+	t->ch = ch;
+	t->hash = fnv_32a_folded(d->name, 4*sizeof(ksh_u32char), mapsize);
+	if (ch == 0) {
+		d->done = 1;
+	} else {
+		memmove(&d->name[0], &d->name[1], 3*sizeof(ksh_u32char));
+		d->name[3] = ch;
+	}
+	return 1;
+}
+
+uint64_t
+record_hash(const char *str, size_t len)
+{
+	// for when a string is looked at without training on it
+	uint64_t hash = RECORD_HASH_INIT;
+	ksh_u32char ch;
+	for (size_t i = 0; i < len && str[i] != 0; ) {
+		int clen = utf8_readcharacter_len(&ch, &str[i], len - i);
+		if (clen < 0) {
 			i++;
 			continue;
 		}
-		i += len;
-		// teach buffer->ch
-		ksh_makeassociation(model, buf, ch);
-		// push ch to buffer for next loop
-		memmove(&buf[0], &buf[1], 3*sizeof(ksh_u32char));
-		buf[3] = ch;
+		i += clen;
+		hash = RECORD_HASH_STEP(hash, ch);
 	}
-	// after the string has been studied, teach to end on it
-	ksh_makeassociation(model, buf, 0);
+	return hash;
 }
 
-void
-ksh_createstring(ksh_model_t *model, char *buf, size_t bufsize)
+#define SEEN_MAXBITS ((uint64_t)1<<36)
+
+int
+ksh_trackrecords(ksh_model_t *model, uint64_t expected_records, int bits_per_record)
 {
-	ksh_u32char name[4] = {0};
-	ksh_u32char ch = 0;
-	int i = 0;
-	while (i < (bufsize-1)) {
-		ch = ksh_getcontinuation(model, name);
-		if (ch == 0)
-			break;
-		// write character as utf-8
-		char encoded[4];
-		int len = utf8_writecharacter(ch, encoded);
-		if ((i+len+1) >= bufsize)
-			break;
-		memcpy(&buf[i], encoded, len);
+	if (bits_per_record < 1)
+		return -1;
+	// seen_check's probes are 32-bit h1 plus up to 15 times a 32-bit h2, so
+	// nothing past SEEN_MAXBITS would ever get set
+	uint64_t bits = 64;
+	while (bits < SEEN_MAXBITS && bits / bits_per_record < expected_records)
+		bits *= 2;
+	uint64_t *seen = calloc(sizeof(uint64_t), bits/64);
+	if (!seen)
+		return -1;
+	free(model->seen);
+	model->seen = seen;
+	model->seenbits = bits;
+	// k = ln2 * bits per record is the optimum
+	model->seenhashes = bits_per_record * 0.69 + 0.5;
+	if (model->seenhashes < 1)
+		model->seenhashes = 1;
+	if (model->seenhashes > 16)
+		model->seenhashes = 16;
+	return 0;
+}
+
+int
+seen_check(ksh_model_t *model, uint64_t hash, int add)
+{
+	// double hashing, every probe is h1 + i*h2
+	uint32_t h1 = hash, h2 = (hash >> 32) | 1;
+	int found = 1;
+	for (int i = 0; i < model->seenhashes; i++) {
+		uint64_t bit = (h1 + (uint64_t)i*h2) & (model->seenbits-1);
+		if (!(model->seen[bit/64] & ((uint64_t)1 << (bit%64)))) {
+			found = 0;
+			if (!add)
+				break;
+			model->seen[bit/64] |= (uint64_t)1 << (bit%64);
+		}
+	}
+	return found;
+}
+
+int
+seen_generated(ksh_model_t *model, const char *buf)
+{
+	// whether buf is (probably) a trained string that should be generated again
+	if (!(model->genflags & KSH_GEN_NOVEL) || !model->seen)
+		return 0;
+	uint64_t hash = RECORD_HASH_INIT;
+	ksh_u32char ch;
+	for (int i = 0; buf[i] != 0; ) {
+		int len = utf8_readcharacter(&ch, &buf[i]);
+		if (len < 0) {
+			i++;
+			continue;
+		}
 		i += len;
-		memmove(&name[0], &name[1], 3*sizeof(ksh_u32char));
-		name[3] = ch;
+		hash = RECORD_HASH_STEP(hash, ch);
 	}
-	buf[i] = 0;
+	return seen_check(model, hash, 0);
 }
 
-/* unsigned leb128:
- * split the number into groups of 7 bits, starting from the lsb.
- * then for every 7-bit group, starting from the lsb, set the eighth bit
- * if there's another group after it, then send that as a byte.
- * 1234 -> 10011010010 -> 1001 1010010 -> (11010010, 00001001)
- * dec     bin            4321 7654321     8         8
- *                       byte2   byte1      [byte1]   [byte2]
+/*
+ * bounded models. decaying is done lazily: every rule remembers the epoch its
+ * counts are from, and whenever it's looked up they're halved once for every
+ * epoch that has passed since. eviction is CLOCK over the hashmap buckets,
+ * looking up a rule sets its reference bit, and the hand clears it or,
+ * if it wasn't set, throws the rule out
  */
+static inline uint32_t*
+cont_prob(ksh_rule_t *rule, struct cont *c)
+{
+	return c->ptr ? &c->ptr->probability[c->i] : &rule->probability[c->i];
+}
+
+static inline ksh_u32char*
+cont_char(ksh_rule_t *rule, struct cont *c)
+{
+	return c->ptr ? &c->ptr->character[c->i] : &rule->character[c->i];
+}
+
+int
+cont_next(ksh_rule_t *rule, struct cont *c)
+{
+	// like append_cont, but only over the slots the rule already has. 0 past the last one
+	c->i++;
+	if (!c->ptr) {
+		if (c->i < KSH_CONTINUATIONS_PER_HEADER)
+			return 1;
+		c->ptr = rule->cont;
+		c->i = 0;
+		return c->ptr != NULL;
+	}
+	if (c->i < KSH_CONTINUATIONS_PER_STRUCT)
+		return 1;
+	c->ptr = c->ptr->next;
+	c->i = 0;
+	return c->ptr != NULL;
+}
+
+int64_t
+decay_rule(ksh_model_t *model, ksh_rule_t *rule)
+{
+	// brings the rule's counts up to the current epoch, and returns the new total.
+	// the continuations that are left get moved to the front and the
+	// continuation structs that end up empty are freed
+	uint32_t age = model->epoch - (rule->stamp & RULE_EPOCH);
+	rule->stamp = (rule->stamp & RULE_REF) | model->epoch;
+	if (age == 0)
+		return rule->probtotal;
+	struct cont rd = {.ptr=0, .i=-1}, wr = {.ptr=0, .i=-1};
+	int64_t total = 0;
+	while (cont_next(rule, &rd)) {
+		uint32_t prob = age < 32 ? *cont_prob(rule, &rd) >> age : 0;
+		if (prob == 0)
+			continue;
+		cont_next(rule, &wr); // never gets ahead of rd
+		*cont_char(rule, &wr) = *cont_char(rule, &rd);
+		*cont_prob(rule, &wr) = prob;
+		total += prob;
+	}
+	ksh_continuations_t *rest;
+	if (!wr.ptr) {
+		for (int i = wr.i+1; i < KSH_CONTINUATIONS_PER_HEADER; i++)
+			rule->character[i] = rule->probability[i] = 0;
+		rest = rule->cont;
+		rule->cont = NULL;
+	} else {
+		for (int i = wr.i+1; i < KSH_CONTINUATIONS_PER_STRUCT; i++)
+			wr.ptr->character[i] = wr.ptr->probability[i] = 0;
+		rest = wr.ptr->next;
+		wr.ptr->next = NULL;
+	}
+	while (rest != NULL) {
+		ksh_continuations_t *next = rest->next;
+		pool_free(&model->contpool, rest);
+		rest = next;
+	}
+	rule->probtotal = total;
+	return total;
+}
+
+ksh_rule_t*
+bounded_touch(ksh_model_t *model, ksh_rule_t **link)
+{
+	// marks the rule *link points to as used and decays it. a rule that
+	// decayed away entirely gets removed, as if it had never been there
+	ksh_rule_t *rule = *link;
+	rule->stamp |= RULE_REF;
+	if (decay_rule(model, rule) > 0)
+		return rule;
+	*link = rule->next;
+	free_rule(model, rule);
+	return NULL;
+}
+
+void
+bounded_sync(ksh_model_t *model, uint64_t b)
+{
+	// decays all of the rules in a bucket, without marking them as used
+	ksh_rule_t **link = &model->hashmap[b];
+	while (*link != NULL) {
+		ksh_rule_t *rule = *link;
+		if (decay_rule(model, rule) > 0) {
+			link = &rule->next;
+		} else {
+			*link = rule->next;
+			free_rule(model, rule);
+		}
+	}
+}
+
+uint64_t
+bounded_bytes(ksh_model_t *model)
+{
+	return ((uint64_t)sizeof(ksh_rule_t*) << model->mapsize)
+		+ model->rulepool.live * sizeof(ksh_rule_t)
+		+ model->contpool.live * sizeof(ksh_continuations_t);
+}
+
+void
+bounded_evict(ksh_model_t *model, uint64_t target)
+{
+	uint64_t mask = ((uint64_t)1 << model->mapsize) - 1;
+	while (model->nrules > 0 && bounded_bytes(model) > target) {
+		ksh_rule_t **link = &model->hashmap[model->clockhand++ & mask];
+		while (*link != NULL) {
+			ksh_rule_t *rule = *link;
+			if (rule->stamp & RULE_REF) { // second chance
+				rule->stamp &= ~RULE_REF;
+				link = &rule->next;
+			} else {
+				*link = rule->next;
+				free_rule(model, rule);
+			}
+		}
+	}
+}
+
+void
+bounded_trained(ksh_model_t *model)
+{
+	// called after every trained string
+	if (model->halflife && ++model->sincedecay >= model->halflife) {
+		model->epoch = (model->epoch + 1) & RULE_EPOCH;
+		model->sincedecay = 0;
+	}
+	// evicting down to a bit under the limit, so it doesn't run after every string
+	if (model->maxbytes && bounded_bytes(model) > model->maxbytes)
+		bounded_evict(model, model->maxbytes - model->maxbytes/8);
+}
+
+int
+ksh_setbounded(ksh_model_t *model, uint64_t maxbytes, uint64_t halflife)
+{
+	if (model->frozen && ksh_thawmodel(model) < 0)
+		return -1;
+	if (model->lazy && lazy_materialize(model) < 0)
+		return -1;
+	if (model->bounded) { // the old halflife doesn't apply anymore
+		for (uint64_t b = 0; b < ((uint64_t)1 << model->mapsize); b++)
+			bounded_sync(model, b);
+	}
+	model->maxbytes = maxbytes;
+	model->halflife = halflife;
+	model->sincedecay = 0;
+	model->bounded = maxbytes || halflife;
+	if (model->maxbytes && bounded_bytes(model) > model->maxbytes)
+		bounded_evict(model, model->maxbytes - model->maxbytes/8);
+	return 0;
+}
+
+#define TRAIN_BATCH 32
+
+int
+train_batch(ksh_model_t *model, struct transition *t, int n, uint32_t weight)
+{
+	// the buckets were prefetched while the transitions were queued, now the
+	// rules in them are, and only then the counts get updated. that way the
+	// cache misses overlap instead of stalling one character at a time
+	if (!model->lazy) { // lazy models might not have the bucket loaded yet
+		for (int i = 0; i < n; i++)
+			__builtin_prefetch(model->hashmap[t[i].hash]);
+	}
+	for (int i = 0; i < n; i++) {
+		if (associate(model, find_create_rule(model, t[i].name, t[i].hash), t[i].ch, weight) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+int
+train_string(ksh_model_t *model, const char *str, size_t len, uint32_t weight, uint64_t *hash)
+{
+	// trains on str and gives its record hash, fails if it runs out of memory
+	struct transition batch[TRAIN_BATCH];
+	int queued = 0;
+	struct decoder d;
+	decoder_init(&d, str, len);
+	while (decoder_next(&d, &batch[queued], model->mapsize)) {
+		__builtin_prefetch(&model->hashmap[batch[queued].hash]);
+		if (++queued == TRAIN_BATCH) {
+			if (train_batch(model, batch, queued, weight) < 0)
+				return -1;
+			queued = 0;
+		}
+	}
+	if (train_batch(model, batch, queued, weight) < 0)
+		return -1;
+	*hash = d.hash;
+	return 0;
+}
+
+void
+ksh_trainmarkov_len(ksh_model_t *model, const char *str, size_t len, uint32_t weight)
+{
+	if (weight == 0)
+		return;
+	if (model->frozen && ksh_thawmodel(model) < 0)
+		return;
+	uint64_t hash;
+	if (train_string(model, str, len, weight, &hash) < 0)
+		return;
+	if (model->seen)
+		seen_check(model, hash, 1);
+	if (model->bounded)
+		bounded_trained(model);
+}
+
+void
+ksh_trainmarkov_weighted(ksh_model_t *model, const char *str, uint32_t weight)
+{
+	ksh_trainmarkov_len(model, str, SIZE_MAX, weight); // the 0 ends it first
+}
+
+void
+ksh_trainmarkov(ksh_model_t *model, const char *str)
+{
+	ksh_trainmarkov_len(model, str, SIZE_MAX, 1);
+}
+
+/*
+ * parallel training. every thread owns a range of buckets, and only it
+ * touches the rules in them, so nothing needs a lock. the strings are still
+ * decoded only once: they go in rounds of TRAIN_ROUND strings per thread.
+ * first every thread decodes its share of the round, sorting the transitions
+ * into one queue for each thread by the bucket of their rule. then (after a
+ * barrier) every thread trains on what it was sent, going through the queues
+ * in the order of the threads that filled them, which is the order of the
+ * strings. a rule gets its transitions in the same order as it would with
+ * one thread, so the model comes out the same
+ */
+
+#define TRAIN_ROUND 4096
+
+struct trainqueue {
+	struct transition *t;
+	size_t n, cap;
+};
+
+struct trainer {
+	ksh_model_t shadow; // shares the hashmap, but has its own pools
+	struct trainpool *pool;
+	int id;
+	struct trainqueue *out; // one for every thread
+};
+
+struct trainpool {
+	ksh_model_t *model;
+	pthread_mutex_t gate; // held until it's known how many threads there are
+	pthread_barrier_t barrier;
+	int nthreads;
+	struct trainer *trainers;
+	const char **strings;
+	const size_t *lens;
+	size_t n;
+	uint64_t *hashes; // record hashes of the round's strings, if they're tracked
+	int failed;
+};
+
+void*
+trainer_run(void *arg)
+{
+	struct trainer *tr = arg;
+	struct trainpool *tp = tr->pool;
+	pthread_mutex_lock(&tp->gate);
+	pthread_mutex_unlock(&tp->gate);
+	int nthreads = tp->nthreads, mapsize = tr->shadow.mapsize;
+	ksh_rule_t **hashmap = tr->shadow.hashmap;
+	for (size_t round = 0; round < tp->n; round += (size_t)TRAIN_ROUND * nthreads) {
+		size_t end = tp->n - round < (size_t)TRAIN_ROUND * nthreads ? tp->n : round + (size_t)TRAIN_ROUND * nthreads;
+		size_t lo = round + (end-round) * tr->id / nthreads;
+		size_t hi = round + (end-round) * (tr->id+1) / nthreads;
+		for (int o = 0; o < nthreads; o++)
+			tr->out[o].n = 0;
+		for (size_t i = lo; i < hi; i++) {
+			struct decoder d;
+			decoder_init(&d, tp->strings[i], tp->lens ? tp->lens[i] : SIZE_MAX);
+			struct transition t;
+			while (decoder_next(&d, &t, mapsize)) {
+				struct trainqueue *q = &tr->out[((uint64_t)t.hash * nthreads) >> mapsize];
+				if (q->n == q->cap) {
+					size_t cap = q->cap ? q->cap*2 : 1024;
+					struct transition *new = realloc(q->t, cap * sizeof(struct transition));
+					if (!new) { // the others are waiting at the barrier, so keep going
+						__atomic_store_n(&tp->failed, 1, __ATOMIC_RELAXED);
+						continue;
+					}
+					q->t = new;
+					q->cap = cap;
+				}
+				q->t[q->n++] = t;
+			}
+			if (tp->hashes)
+				tp->hashes[i - round] = d.hash;
+		}
+		pthread_barrier_wait(&tp->barrier);
+		for (int p = 0; p < nthreads; p++) {
+			struct trainqueue *q = &tp->trainers[p].out[tr->id];
+			for (size_t j = 0; j < q->n; j += TRAIN_BATCH) {
+				int batch = q->n - j < TRAIN_BATCH ? q->n - j : TRAIN_BATCH;
+				for (int k = 0; k < batch; k++)
+					__builtin_prefetch(&hashmap[q->t[j+k].hash]);
+				if (train_batch(&tr->shadow, &q->t[j], batch, 1) < 0)
+					__atomic_store_n(&tp->failed, 1, __ATOMIC_RELAXED);
+			}
+		}
+		if (tr->id == 0 && tp->hashes) { // the filter is only ever touched here
+			for (size_t i = round; i < end; i++)
+				seen_check(tp->model, tp->hashes[i - round], 1);
+		}
+		pthread_barrier_wait(&tp->barrier);
+	}
+	return NULL;
+}
+
+int
+ksh_trainmarkov_parallel(ksh_model_t *model, const char **strings, const size_t *lens, size_t n, int nthreads)
+{
+	if (model->frozen && ksh_thawmodel(model) < 0)
+		return -1;
+	if (model->lazy && lazy_materialize(model) < 0)
+		return -1;
+	if (nthreads <= 1 || model->bounded) {
+		// decay and eviction go string by string, bounded models can't be split up
+		for (size_t i = 0; i < n; i++)
+			ksh_trainmarkov_len(model, strings[i], lens ? lens[i] : SIZE_MAX, 1);
+		return 0;
+	}
+	uint64_t nbuckets = (uint64_t)1 << model->mapsize;
+	if (nthreads > nbuckets)
+		nthreads = nbuckets;
+	struct trainpool tp = {0};
+	tp.model = model;
+	tp.strings = strings;
+	tp.lens = lens;
+	tp.n = n;
+	tp.trainers = calloc(sizeof(struct trainer), nthreads);
+	pthread_t *threads = calloc(sizeof(pthread_t), nthreads);
+	if (model->seen)
+		tp.hashes = malloc((size_t)TRAIN_ROUND * nthreads * sizeof(uint64_t));
+	int ret = -1;
+	if (!tp.trainers || !threads || (model->seen && !tp.hashes))
+		goto trainmarkov_parallel_end;
+	for (int t = 0; t < nthreads; t++) {
+		shadow_init(&tp.trainers[t].shadow, model);
+		tp.trainers[t].pool = &tp;
+		tp.trainers[t].id = t;
+		tp.trainers[t].out = calloc(sizeof(struct trainqueue), nthreads);
+		if (!tp.trainers[t].out)
+			goto trainmarkov_parallel_end;
+	}
+	// this thread is number 0. the rest wait at the gate until it's known how
+	// many of them could be started, that decides which buckets are whose
+	pthread_mutex_init(&tp.gate, NULL);
+	pthread_mutex_lock(&tp.gate);
+	int started = 1;
+	for (int t = 1; t < nthreads; t++) {
+		if (pthread_create(&threads[t], NULL, trainer_run, &tp.trainers[t]) != 0)
+			break;
+		started++;
+	}
+	tp.nthreads = started;
+	pthread_barrier_init(&tp.barrier, NULL, started);
+	pthread_mutex_unlock(&tp.gate);
+	trainer_run(&tp.trainers[0]);
+	for (int t = 1; t < started; t++)
+		pthread_join(threads[t], NULL);
+	pthread_barrier_destroy(&tp.barrier);
+	pthread_mutex_destroy(&tp.gate);
+	for (int t = 0; t < nthreads; t++) {
+		pool_adopt(&model->rulepool, &tp.trainers[t].shadow.rulepool);
+		pool_adopt(&model->contpool, &tp.trainers[t].shadow.contpool);
+		model->nrules += tp.trainers[t].shadow.nrules;
+	}
+	ret = __atomic_load_n(&tp.failed, __ATOMIC_RELAXED) ? -1 : 0;
+
+	trainmarkov_parallel_end:
+	if (tp.trainers) {
+		for (int t = 0; t < nthreads; t++) {
+			if (tp.trainers[t].out) {
+				for (int o = 0; o < nthreads; o++)
+					free(tp.trainers[t].out[o].t);
+			}
+			free(tp.trainers[t].out);
+		}
+	}
+	free(tp.trainers);
+	free(threads);
+	free(tp.hashes);
+	return ret;
+}
+
+void
+createstring_frozen(ksh_frozen_t *fz, int64_t (*rng)(void*, int64_t), void *rngdata, char *buf, size_t bufsize)
+{
+	ksh_u32char *chars = FROZEN_CHARS(fz);
+	uint32_t *links = FROZEN_LINKS(fz);
+	ksh_u32char name[4] = {0};
+	uint32_t rule = frozen_find(fz, name);
+	int i = 0;
+	while (rule != KSH_NOLINK && i < (bufsize-1)) {
+		uint32_t c = frozen_pick(fz, rule, rng, rngdata);
+		if (c == KSH_NOLINK || chars[c] == 0)
+			break;
+		char encoded[4];
+		int len = utf8_writecharacter(chars[c], encoded);
+		if ((i+len+1) >= bufsize)
+			break;
+		memcpy(&buf[i], encoded, len);
+		i += len;
+		rule = links[c]; // no need to touch the hashmap at all
+	}
+	buf[i] = 0;
+}
+
+/*
+ * tries. the hashmap (and frozen form) store the whole 4 character name with
+ * every rule, but most rules share their first characters with many others.
+ * the trie stores every distinct prefix once: level 0 has a node for every
+ * distinct name[0], level 1 for every distinct name[0..1], and so on, with
+ * level 3 being the rules themselves. each level is one sorted array of
+ * codepoints, and a node's children are a contiguous range of the next level.
+ * every rule also points back at the level 2 node for its name[1..3], so
+ * generating the next character is a single search among its children
+ */
+#define TRIE_LINEAR 16 // child ranges up to this long are scanned instead of bisected
+
+struct ksh_trie_t {
+	uint32_t nnodes[4];
+	uint32_t nconts;
+	ksh_u32char *label[4]; // the codepoint of every node on each level
+	uint32_t *child[3]; // first child of every node on levels 0-2, nnodes+1 entries
+	// level 3
+	uint32_t *first; // first continuation of every rule, nnodes[3]+1 entries
+	int64_t *probtotal;
+	uint32_t *suffix; // level 2 node for name[1..3], or KSH_NOLINK
+	ksh_u32char *chars;
+	uint32_t *probs;
+};
+
+static inline uint32_t
+trie_search(const ksh_u32char *labels, uint32_t lo, uint32_t hi, ksh_u32char ch)
+{
+	// index of ch among labels[lo..hi), or KSH_NOLINK
+	while (hi - lo > TRIE_LINEAR) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (labels[mid] <= ch)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	uint32_t i = find_char(&labels[lo], hi - lo, ch);
+	return i < hi - lo ? lo + i : KSH_NOLINK;
+}
+
+uint32_t
+trie_find(ksh_trie_t *trie, ksh_u32char *name, int depth)
+{
+	// the node for name[0..depth) on level depth-1, or KSH_NOLINK
+	uint32_t lo = 0, hi = trie->nnodes[0];
+	uint32_t node = KSH_NOLINK;
+	for (int l = 0; l < depth; l++) {
+		node = trie_search(trie->label[l], lo, hi, name[l]);
+		if (node == KSH_NOLINK || l == 3)
+			break;
+		lo = trie->child[l][node];
+		hi = trie->child[l][node+1];
+	}
+	return node;
+}
+
+int
+trie_namecmp(const void *a, const void *b)
+{
+	const ksh_u32char *x = (*(ksh_rule_t**)a)->name, *y = (*(ksh_rule_t**)b)->name;
+	for (int i = 0; i < 4; i++) {
+		if (x[i] != y[i])
+			return x[i] < y[i] ? -1 : 1;
+	}
+	return 0;
+}
+
+ksh_trie_t*
+ksh_buildtrie(ksh_model_t *model)
+{
+	if (model->base)
+		return NULL;
+	if (model->frozen) {
+		ksh_model_t *copy = thawed_copy(model);
+		if (!copy)
+			return NULL;
+		ksh_trie_t *trie = ksh_buildtrie(copy);
+		ksh_freemodel(copy);
+		return trie;
+	}
+	if (model->lazy && lazy_materialize(model) < 0)
+		return NULL;
+	ksh_trie_t *trie = calloc(1, sizeof(ksh_trie_t));
+	ksh_rule_t **sorted = malloc((model->nrules ? model->nrules : 1) * sizeof(ksh_rule_t*));
+	if (!trie || !sorted || model->nrules >= KSH_NOLINK)
+		goto buildtrie_fail;
+	uint64_t n = 0, nconts = 0;
+	for (uint64_t b = 0; b < ((uint64_t)1 << model->mapsize); b++) {
+		if (model->bounded)
+			bounded_sync(model, b);
+		for (ksh_rule_t *rule = model->hashmap[b]; rule != NULL; rule = rule->next) {
+			sorted[n++] = rule;
+			struct cont c = {.ptr=0, .i=-1};
+			while (cont_next(rule, &c))
+				nconts += *cont_prob(rule, &c) != 0;
+		}
+	}
+	if (nconts >= KSH_NOLINK)
+		goto buildtrie_fail;
+	qsort(sorted, n, sizeof(ksh_rule_t*), trie_namecmp);
+	// the upper levels have at most as many nodes as there are rules, and are shrunk afterwards
+	for (int l = 0; l < 4; l++) {
+		trie->label[l] = malloc((n ? n : 1) * sizeof(ksh_u32char));
+		if (!trie->label[l])
+			goto buildtrie_fail;
+	}
+	for (int l = 0; l < 3; l++) {
+		trie->child[l] = malloc((n+1) * sizeof(uint32_t));
+		if (!trie->child[l])
+			goto buildtrie_fail;
+	}
+	trie->first = malloc((n+1) * sizeof(uint32_t));
+	trie->probtotal = malloc((n ? n : 1) * sizeof(int64_t));
+	trie->suffix = malloc((n ? n : 1) * sizeof(uint32_t));
+	trie->chars = malloc((nconts ? nconts : 1) * sizeof(ksh_u32char));
+	trie->probs = malloc((nconts ? nconts : 1) * sizeof(uint32_t));
+	if (!trie->first || !trie->probtotal || !trie->suffix || !trie->chars || !trie->probs)
+		goto buildtrie_fail;
+	uint32_t *nnodes = trie->nnodes;
+	uint32_t c = 0;
+	for (uint64_t i = 0; i < n; i++) {
+		ksh_rule_t *rule = sorted[i];
+		// the first level where this name differs from the previous one gets
+		// a new node, and so does every level below it
+		int l = 0;
+		if (i > 0) {
+			while (l < 3 && rule->name[l] == sorted[i-1]->name[l])
+				l++;
+		}
+		for (; l < 4; l++) {
+			trie->label[l][nnodes[l]] = rule->name[l];
+			if (l < 3)
+				trie->child[l][nnodes[l]] = nnodes[l+1];
+			nnodes[l]++;
+		}
+		trie->first[i] = c;
+		trie->probtotal[i] = rule->probtotal;
+		struct cont ct = {.ptr=0, .i=-1};
+		while (cont_next(rule, &ct)) {
+			if (*cont_prob(rule, &ct) == 0)
+				continue;
+			trie->chars[c] = *cont_char(rule, &ct);
+			trie->probs[c] = *cont_prob(rule, &ct);
+			c++;
+		}
+	}
+	for (int l = 0; l < 3; l++)
+		trie->child[l][nnodes[l]] = nnodes[l+1];
+	trie->first[n] = c;
+	trie->nconts = c;
+	for (int l = 0; l < 3; l++) {
+		ksh_u32char *label = realloc(trie->label[l], (nnodes[l] ? nnodes[l] : 1) * sizeof(ksh_u32char));
+		uint32_t *child = realloc(trie->child[l], (nnodes[l]+1) * sizeof(uint32_t));
+		if (label)
+			trie->label[l] = label;
+		if (child)
+			trie->child[l] = child;
+	}
+	for (uint64_t i = 0; i < n; i++)
+		trie->suffix[i] = trie_find(trie, &sorted[i]->name[1], 3);
+	free(sorted);
+	return trie;
+
+	buildtrie_fail:
+	free(sorted);
+	ksh_freetrie(trie);
+	return NULL;
+}
+
+void
+ksh_freetrie(ksh_trie_t *trie)
+{
+	if (!trie)
+		return;
+	for (int l = 0; l < 4; l++)
+		free(trie->label[l]);
+	for (int l = 0; l < 3; l++)
+		free(trie->child[l]);
+	free(trie->first);
+	free(trie->probtotal);
+	free(trie->suffix);
+	free(trie->chars);
+	free(trie->probs);
+	free(trie);
+}
+
+size_t
+ksh_triesize(ksh_trie_t *trie)
+{
+	size_t size = sizeof(ksh_trie_t);
+	for (int l = 0; l < 4; l++)
+		size += trie->nnodes[l] * sizeof(ksh_u32char);
+	for (int l = 0; l < 3; l++)
+		size += (trie->nnodes[l]+1) * sizeof(uint32_t);
+	size += (trie->nnodes[3]+1) * sizeof(uint32_t) + trie->nnodes[3] * (sizeof(int64_t) + sizeof(uint32_t));
+	size += trie->nconts * (sizeof(ksh_u32char) + sizeof(uint32_t));
+	return size;
+}
+
+uint32_t
+trie_pick(ksh_model_t *model, ksh_trie_t *trie, uint32_t rule)
+{
+	// same as frozen_pick, returns the index of a continuation or KSH_NOLINK
+	uint32_t first = trie->first[rule], count = trie->first[rule+1] - first;
+	int64_t r = model->rng(model->rngdata, trie->probtotal[rule]);
+	uint32_t i = find_threshold(&trie->probs[first], count, &r, trie->probtotal[rule]);
+	return i < count ? first + i : KSH_NOLINK;
+}
+
+ksh_u32char
+ksh_trie_getcontinuation(ksh_model_t *model, ksh_trie_t *trie, ksh_u32char *name)
+{
+	uint32_t rule = trie_find(trie, name, 4);
+	if (rule == KSH_NOLINK)
+		return 0;
+	uint32_t c = trie_pick(model, trie, rule);
+	return c == KSH_NOLINK ? 0 : trie->chars[c];
+}
+
+void
+ksh_trie_createstring(ksh_model_t *model, ksh_trie_t *trie, char *buf, size_t bufsize)
+{
+	ksh_u32char name[4] = {0};
+	uint32_t rule = trie_find(trie, name, 4);
+	int i = 0;
+	while (rule != KSH_NOLINK && i < (bufsize-1)) {
+		uint32_t c = trie_pick(model, trie, rule);
+		if (c == KSH_NOLINK || trie->chars[c] == 0)
+			break;
+		char encoded[4];
+		int len = utf8_writecharacter(trie->chars[c], encoded);
+		if ((i+len+1) >= bufsize)
+			break;
+		memcpy(&buf[i], encoded, len);
+		i += len;
+		// the next rule is name[1..3]+ch, one of the children of the suffix node
+		uint32_t s = trie->suffix[rule];
+		rule = s == KSH_NOLINK ? KSH_NOLINK :
+			trie_search(trie->label[3], trie->child[2][s], trie->child[2][s+1], trie->chars[c]);
+	}
+	buf[i] = 0;
+}
+
+#define REACH_INF 0xFFFF
+#define REACH_EXACT 64
+
+int
+reach_build(ksh_model_t *model)
+{
+	// for every rule: at which of the next 64 characters the string can end (exactly,
+	// as a bitmask), and past that just the fewest and most characters it can still
+	// produce (REACH_INF if it can get into a loop).
+	// a continuation leading to a rule that doesn't exist ends the string too
+	ksh_frozen_t *fz = model->frozen;
+	ksh_frozenrule_t *rules = FROZEN_RULES(fz);
+	ksh_u32char *chars = FROZEN_CHARS(fz);
+	uint32_t *links = FROZEN_LINKS(fz);
+	uint32_t n = fz->nrules;
+	ksh_reach_t *reach = malloc(sizeof(ksh_reach_t)*n);
+	uint32_t *predstart = calloc(sizeof(uint32_t), n+1); // predecessors of every rule
+	uint32_t *preds = malloc(sizeof(uint32_t)*(fz->nconts+1));
+	uint32_t *outdeg = calloc(sizeof(uint32_t), n);
+	uint32_t *queue = malloc(sizeof(uint32_t)*(n+1));
+	if (!reach || !predstart || !preds || !outdeg || !queue) {
+		free(reach);
+		free(predstart);
+		free(preds);
+		free(outdeg);
+		free(queue);
+		return -1;
+	}
+	for (uint32_t i = 0; i < n; i++) {
+		for (uint32_t j = rules[i].first; j < rules[i].first + rules[i].count; j++) {
+			if (links[j] != KSH_NOLINK) {
+				predstart[links[j]+1]++;
+				outdeg[i]++;
+			}
+		}
+	}
+	for (uint32_t i = 0; i < n; i++)
+		predstart[i+1] += predstart[i];
+	for (uint32_t i = 0; i < n; i++) {
+		for (uint32_t j = rules[i].first; j < rules[i].first + rules[i].count; j++) {
+			if (links[j] != KSH_NOLINK)
+				preds[predstart[links[j]]++] = i;
+		}
+	}
+	for (uint32_t i = n; i > 0; i--) // filling moved every start to the next one's
+		predstart[i] = predstart[i-1];
+	predstart[0] = 0;
+
+	// exact lengths: a bit for length k needs a path of k steps, so it settles within 64 passes
+	for (uint32_t i = 0; i < n; i++)
+		reach[i].lengths = 0;
+	for (int pass = 0, changed = 1; changed && pass <= REACH_EXACT; pass++) {
+		changed = 0;
+		for (uint32_t i = 0; i < n; i++) {
+			uint64_t lengths = 0;
+			for (uint32_t j = rules[i].first; j < rules[i].first + rules[i].count; j++) {
+				if (chars[j] == 0)
+					lengths |= 1;
+				else if (links[j] == KSH_NOLINK)
+					lengths |= 2;
+				else
+					lengths |= reach[links[j]].lengths << 1;
+			}
+			if (lengths != reach[i].lengths) {
+				reach[i].lengths = lengths;
+				changed = 1;
+			}
+		}
+	}
+
+	// fewest: breadth-first from the rules that can end right away (0) or after one character (1)
+	uint32_t head = 0, tail = 0;
+	for (int level = 0; level < 2; level++) {
+		for (uint32_t i = 0; i < n; i++) {
+			if (level == 0)
+				reach[i].fewest = REACH_INF;
+			if (reach[i].fewest == REACH_INF && (reach[i].lengths & (1<<level))) {
+				reach[i].fewest = level;
+				queue[tail++] = i;
+			}
+		}
+	}
+	while (head < tail) {
+		uint32_t i = queue[head++];
+		for (uint32_t p = predstart[i]; p < predstart[i+1]; p++) {
+			if (reach[preds[p]].fewest == REACH_INF) {
+				reach[preds[p]].fewest = reach[i].fewest + 1 < REACH_INF ? reach[i].fewest + 1 : REACH_INF-1;
+				queue[tail++] = preds[p];
+			}
+		}
+	}
+
+	// most: peel off rules whose successors are all done, in reverse topological order.
+	// whatever is left over can reach a loop and go on forever
+	head = tail = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		reach[i].most = REACH_INF;
+		if (outdeg[i] == 0)
+			queue[tail++] = i;
+	}
+	while (head < tail) {
+		uint32_t i = queue[head++];
+		uint32_t most = 0;
+		for (uint32_t j = rules[i].first; j < rules[i].first + rules[i].count; j++) {
+			uint32_t len = chars[j] == 0 ? 0 : links[j] == KSH_NOLINK ? 1 : reach[links[j]].most + 1;
+			if (len > most)
+				most = len;
+		}
+		reach[i].most = most < REACH_INF ? most : REACH_INF;
+		for (uint32_t p = predstart[i]; p < predstart[i+1]; p++) {
+			if (--outdeg[preds[p]] == 0)
+				queue[tail++] = preds[p];
+		}
+	}
+	free(predstart);
+	free(preds);
+	free(outdeg);
+	free(queue);
+	model->reach = reach;
+	return 0;
+}
+
+static inline int
+reach_allows(ksh_model_t *model, uint32_t j, int64_t n, int64_t minlen, int64_t maxlen)
+{
+	// whether taking continuation j at length n can still end between minlen and maxlen
+	ksh_frozen_t *fz = model->frozen;
+	uint32_t link = FROZEN_LINKS(fz)[j];
+	if (FROZEN_CHARS(fz)[j] == 0)
+		return n >= minlen;
+	if (link == KSH_NOLINK)
+		return n+1 >= minlen && n+1 <= maxlen;
+	// how many more characters the next rule may produce
+	int64_t lo = minlen - (n+1), hi = maxlen - (n+1);
+	if (lo < 0)
+		lo = 0;
+	if (hi < lo)
+		return 0;
+	ksh_reach_t *r = &model->reach[link];
+	if (lo < REACH_EXACT) {
+		uint64_t window = ~(uint64_t)0 << lo;
+		if (hi < REACH_EXACT-1)
+			window &= ~(~(uint64_t)0 << (hi+1));
+		if (r->lengths & window)
+			return 1;
+		lo = REACH_EXACT;
+	}
+	return hi >= lo && r->fewest <= hi && (r->most == REACH_INF || r->most >= lo);
+}
+
+int
+createstring_ex(ksh_model_t *model, char *buf, size_t bufsize, const char *prefix, int minlen, int maxlen)
+{
+	if (bufsize == 0)
+		return -1;
+	if (!model->frozen && ksh_freezemodel(model) < 0)
+		return -1;
+	if (!model->reach && reach_build(model) < 0)
+		return -1;
+	if (maxlen <= 0)
+		maxlen = INT32_MAX;
+	ksh_frozen_t *fz = model->frozen;
+	ksh_frozenrule_t *rules = FROZEN_RULES(fz);
+	ksh_u32char *chars = FROZEN_CHARS(fz);
+	uint32_t *probs = FROZEN_PROBS(fz);
+	uint32_t *links = FROZEN_LINKS(fz);
+
+	// seed the window with the prefix, which is copied over as-is
+	ksh_u32char name[4] = {0};
+	int n = 0;
+	size_t i = 0;
+	for (size_t p = 0; prefix && prefix[p] != 0; ) {
+		ksh_u32char ch;
+		int len = utf8_readcharacter(&ch, &prefix[p]);
+		if (len < 0) {
+			p++;
+			continue;
+		}
+		if (i+len >= bufsize)
+			return -1;
+		memcpy(&buf[i], &prefix[p], len);
+		i += len;
+		p += len;
+		n++;
+		memmove(&name[0], &name[1], 3*sizeof(ksh_u32char));
+		name[3] = ch;
+	}
+	buf[i] = 0;
+	if (n > maxlen)
+		return -1;
+	uint32_t rule = frozen_find(fz, name);
+
+	while (rule != KSH_NOLINK) {
+		// only keep the continuations that can still end up between minlen and maxlen
+		int64_t total = 0;
+		for (uint32_t j = rules[rule].first; j < rules[rule].first + rules[rule].count; j++) {
+			if (reach_allows(model, j, n, minlen, maxlen))
+				total += probs[j];
+		}
+		if (total == 0)
+			return -1; // nowhere left to go
+		int64_t r = model->rng(model->rngdata, total);
+		uint32_t c;
+		for (c = rules[rule].first; c < rules[rule].first + rules[rule].count; c++) {
+			if (!reach_allows(model, c, n, minlen, maxlen))
+				continue;
+			r -= probs[c];
+			if (r < 0)
+				break;
+		}
+		if (chars[c] == 0)
+			break;
+		char encoded[4];
+		int len = utf8_writecharacter(chars[c], encoded);
+		if ((i+len+1) > bufsize) {
+			buf[i] = 0;
+			return -1; // doesn't fit
+		}
+		memcpy(&buf[i], encoded, len);
+		i += len;
+		n++;
+		rule = links[c];
+	}
+	buf[i] = 0;
+	if (n < minlen || n > maxlen)
+		return -1; // only possible if the prefix itself isn't in the model
+	return n;
+}
+
+int
+ksh_createstring_ex(ksh_model_t *model, char *buf, size_t bufsize, const char *prefix, int minlen, int maxlen)
+{
+	int n;
+	for (int tries = 0; tries < KSH_NOVEL_TRIES; tries++) {
+		n = createstring_ex(model, buf, bufsize, prefix, minlen, maxlen);
+		if (n < 0 || !seen_generated(model, buf))
+			break;
+	}
+	return n;
+}
+
+void
+createstring(ksh_model_t *model, char *buf, size_t bufsize)
+{
+	if (model->frozen) {
+		createstring_frozen(model->frozen, model->rng, model->rngdata, buf, bufsize);
+		return;
+	}
+	ksh_u32char name[4] = {0};
+	ksh_u32char ch = 0;
+	int i = 0;
+	while (i < (bufsize-1)) {
+		ch = ksh_getcontinuation(model, name);
+		if (ch == 0)
+			break;
+		// write character as utf-8
+		char encoded[4];
+		int len = utf8_writecharacter(ch, encoded);
+		if ((i+len+1) >= bufsize)
+			break;
+		memcpy(&buf[i], encoded, len);
+		i += len;
+		memmove(&name[0], &name[1], 3*sizeof(ksh_u32char));
+		name[3] = ch;
+	}
+	buf[i] = 0;
+}
+
+void
+ksh_createstring(ksh_model_t *model, char *buf, size_t bufsize)
+{
+	for (int tries = 0; tries < KSH_NOVEL_TRIES; tries++) {
+		createstring(model, buf, bufsize);
+		if (!seen_generated(model, buf))
+			break;
+	}
+}
+
+int
+ksh_createstring_at(ksh_model_t *model, uint32_t stream, uint64_t index, char *buf, size_t bufsize)
+{
+	// only the key is taken from the model's rng, the string gets a state of its own
+	struct rngstate *shared = model->rngdata;
+	if (model->rng != defaultrng || shared->engine != KSH_RNG_PHILOX)
+		return -1;
+	if (!model->frozen && ksh_freezemodel(model) < 0)
+		return -1;
+	struct rngstate s;
+	s.engine = KSH_RNG_PHILOX;
+	memcpy(s.e.philox.key, shared->e.philox.key, sizeof(s.e.philox.key));
+	s.e.philox.ctr[0] = 0;
+	s.e.philox.ctr[1] = index;
+	s.e.philox.ctr[2] = index >> 32;
+	s.e.philox.ctr[3] = stream;
+	s.left = 0;
+	for (int tries = 0; tries < KSH_NOVEL_TRIES; tries++) {
+		createstring_frozen(model->frozen, defaultrng, &s, buf, bufsize);
+		if (!seen_generated(model, buf))
+			break;
+	}
+	return 0;
+}
+
+struct ksh_gen_t {
+	ksh_model_t *model;
+	ksh_u32char name[4]; // the last 4 characters
+	uint32_t rule; // the frozen rule named name, if the model is frozen
+	int done;
+};
+
+ksh_gen_t*
+ksh_gen_begin(ksh_model_t *model)
+{
+	ksh_gen_t *gen = calloc(1, sizeof(ksh_gen_t));
+	if (!gen)
+		return NULL;
+	gen->model = model;
+	gen->rule = KSH_NOLINK;
+	return gen;
+}
+
+ksh_u32char
+ksh_gen_next(ksh_gen_t *gen)
+{
+	if (gen->done)
+		return 0;
+	ksh_model_t *model = gen->model;
+	ksh_u32char ch = 0;
+	if (model->frozen) {
+		// the model could have been thawed and frozen again since the last
+		// step, so the link is only trusted if it still leads to the same name
+		ksh_frozen_t *fz = model->frozen;
+		ksh_frozenrule_t *rules = FROZEN_RULES(fz);
+		if (gen->rule >= fz->nrules || memcmp(rules[gen->rule].name, gen->name, 4*sizeof(ksh_u32char)))
+			gen->rule = frozen_find(fz, gen->name);
+		uint32_t c = gen->rule == KSH_NOLINK ? KSH_NOLINK : frozen_pick(fz, gen->rule, model->rng, model->rngdata);
+		if (c != KSH_NOLINK) {
+			ch = FROZEN_CHARS(fz)[c];
+			gen->rule = FROZEN_LINKS(fz)[c];
+		}
+	} else {
+		ch = ksh_getcontinuation(model, gen->name);
+	}
+	if (ch == 0) {
+		gen->done = 1;
+		return 0;
+	}
+	memmove(&gen->name[0], &gen->name[1], 3*sizeof(ksh_u32char));
+	gen->name[3] = ch;
+	return ch;
+}
+
+int
+ksh_gen_next_utf8(ksh_gen_t *gen, char *out)
+{
+	ksh_u32char ch = ksh_gen_next(gen);
+	return ch ? utf8_writecharacter(ch, out) : 0;
+}
+
+void
+ksh_gen_free(ksh_gen_t *gen)
+{
+	free(gen);
+}
+
+#define SCORE_BATCH 64
+
+uint32_t
+rule_count(ksh_rule_t *rule, ksh_u32char ch)
+{
+	for (int i = 0; i < KSH_CONTINUATIONS_PER_HEADER; i++) {
+		if (rule->character[i] == ch && rule->probability[i])
+			return rule->probability[i];
+	}
+	for (ksh_continuations_t *c = rule->cont; c != NULL; c = c->next) {
+		int i = find_char(c->character, KSH_CONTINUATIONS_PER_STRUCT, ch);
+		if (i < KSH_CONTINUATIONS_PER_STRUCT)
+			return c->probability[i];
+	}
+	return 0;
+}
+
+void
+score_batch(ksh_model_t *model, struct transition *t, int n, double *out)
+{
+	// first send every bucket on its way into the cache, then the rules they point to,
+	// and only then go looking through them, so the cache misses overlap
+	if (model->frozen) {
+		ksh_frozen_t *fz = model->frozen;
+		uint32_t *buckets = FROZEN_BUCKETS(fz);
+		ksh_frozenrule_t *rules = FROZEN_RULES(fz);
+		for (int i = 0; i < n; i++) {
+			t[i].hash = fnv_32a_folded(t[i].name, 4*sizeof(ksh_u32char), fz->mapsize);
+			__builtin_prefetch(&buckets[t[i].hash]);
+		}
+		for (int i = 0; i < n; i++)
+			__builtin_prefetch(&rules[buckets[t[i].hash]]);
+		for (int i = 0; i < n; i++) {
+			uint32_t count = 0;
+			ksh_frozenrule_t *rule = NULL;
+			for (uint32_t r = buckets[t[i].hash]; r < buckets[t[i].hash+1]; r++) {
+				if (0 == memcmp(t[i].name, rules[r].name, 4*sizeof(ksh_u32char))) {
+					rule = &rules[r];
+					break;
+				}
+			}
+			if (rule) {
+				uint32_t j = find_char(&FROZEN_CHARS(fz)[rule->first], rule->count, t[i].ch);
+				if (j < rule->count)
+					count = FROZEN_PROBS(fz)[rule->first+j];
+			}
+			out[t[i].string] += count ? log((double)count / rule->probtotal) : -INFINITY;
+		}
+		return;
+	}
+	for (int i = 0; i < n; i++) {
+		t[i].hash = fnv_32a_folded(t[i].name, 4*sizeof(ksh_u32char), model->mapsize);
+		__builtin_prefetch(&model->hashmap[t[i].hash]);
+	}
+	if (!model->lazy) { // lazy models might not have the bucket loaded yet
+		for (int i = 0; i < n; i++)
+			__builtin_prefetch(model->hashmap[t[i].hash]);
+	}
+	for (int i = 0; i < n; i++) {
+		ksh_rule_t *rule = find_rule(model, t[i].name, t[i].hash);
+		uint64_t count = rule ? rule_count(rule, t[i].ch) : 0;
+		int64_t total = rule ? rule->probtotal : 0;
+		ksh_frozenrule_t *under = overlay_find(model, t[i].name);
+		if (under) {
+			ksh_frozen_t *fz = model->base->frozen;
+			uint32_t j = find_char(&FROZEN_CHARS(fz)[under->first], under->count, t[i].ch);
+			if (j < under->count)
+				count += FROZEN_PROBS(fz)[under->first+j];
+			total += under->probtotal;
+		}
+		out[t[i].string] += count ? log((double)count / total) : -INFINITY;
+	}
+}
+
+void
+ksh_scorestrings_len(ksh_model_t *model, const char **strings, const size_t *lens, size_t n, double *out_logprob)
+{
+	struct transition batch[SCORE_BATCH];
+	int queued = 0;
+	for (size_t s = 0; s < n; s++) {
+		out_logprob[s] = 0;
+		ksh_u32char name[4] = {0};
+		ksh_u32char ch;
+		const char *str = strings[s];
+		size_t len = lens ? lens[s] : SIZE_MAX;
+		size_t i = 0;
+		while (1) {
+			if (i >= len || str[i] == 0) {
+				ch = 0; // the string ending is a transition too
+			} else {
+				int clen = utf8_readcharacter_len(&ch, &str[i], len - i);
+				if (clen < 0) { // skipped, just like in training
+					i++;
+					continue;
+				}
+				i += clen;
+			}
+			memcpy(batch[queued].name, name, 4*sizeof(ksh_u32char));
+			batch[queued].ch = ch;
+			batch[queued].string = s;
+			if (++queued == SCORE_BATCH) {
+				score_batch(model, batch, queued, out_logprob);
+				queued = 0;
+			}
+			if (ch == 0)
+				break;
+			memmove(&name[0], &name[1], 3*sizeof(ksh_u32char));
+			name[3] = ch;
+		}
+	}
+	score_batch(model, batch, queued, out_logprob);
+}
+
+void
+ksh_scorestrings(ksh_model_t *model, const char **strings, size_t n, double *out_logprob)
+{
+	ksh_scorestrings_len(model, strings, NULL, n, out_logprob);
+}
+
+int
+mapsize_for(uint64_t nrules)
+{
+	// one rule per bucket on average
+	int mapsize = 8;
+	while (mapsize < 30 && ((uint64_t)1<<mapsize) < nrules)
+		mapsize++;
+	return mapsize;
+}
+
+int
+ksh_reserve(ksh_model_t *model, uint64_t expected_rules)
+{
+	if (model->frozen && ksh_thawmodel(model) < 0)
+		return -1;
+	if (model->lazy && lazy_materialize(model) < 0)
+		return -1;
+	int mapsize = mapsize_for(expected_rules);
+	if (mapsize > model->mapsize) {
+		// the hash is folded to the map size, so everything has to be rehashed
+		ksh_rule_t **hashmap = placed_alloc(sizeof(ksh_rule_t*) << mapsize, model->allocflags, model->allocnode);
+		if (!hashmap)
+			return -1;
+		for (uint64_t i = 0; i < (1<<model->mapsize); i++) {
+			ksh_rule_t *rule = model->hashmap[i];
+			while (rule != NULL) {
+				ksh_rule_t *next = rule->next;
+				uint32_t hash = fnv_32a_folded(rule->name, 4*sizeof(ksh_u32char), mapsize);
+				rule->next = hashmap[hash];
+				hashmap[hash] = rule;
+				rule = next;
+			}
+		}
+		placed_free(model->hashmap);
+		model->hashmap = hashmap;
+		model->mapsize = mapsize;
+	}
+	if (expected_rules > model->nrules) {
+		// going by the numbers from v1, less than half of the rules need a continuation struct
+		uint64_t n = expected_rules - model->nrules;
+		if (pool_reserve(&model->rulepool, n) < 0 || pool_reserve(&model->contpool, n/2) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+ksh_model_t*
+ksh_createmodel_sized(uint64_t expected_rules, int64_t (*rng)(void*, int64_t), uint32_t seed)
+{
+	ksh_model_t *model = ksh_createmodel(mapsize_for(expected_rules), rng, seed);
+	if (!model)
+		return NULL;
+	if (ksh_reserve(model, expected_rules) < 0) {
+		ksh_freemodel(model);
+		return NULL;
+	}
+	return model;
+}
+
+uint64_t
+ksh_estimaterules(const char *sample, size_t samplelen, uint64_t totalsize)
+{
+	// count the distinct rule names in the sample, and in its first half.
+	// the growth between the two gives the exponent for heaps' law
+	// (distinct ~ k * n^beta), which is then used to extrapolate to totalsize
+	size_t setsize = 64;
+	while (setsize < samplelen*2)
+		setsize *= 2;
+	uint32_t *set = calloc(sizeof(uint32_t), setsize); // name hashes, 0 is empty
+	if (!set)
+		return 0;
+	uint64_t distinct = 0, halfdistinct = 0;
+	ksh_u32char name[4] = {0};
+	size_t i = 0;
+	while (1) {
+		if (i >= samplelen/2 && !halfdistinct)
+			halfdistinct = distinct;
+		if (i >= samplelen)
+			break;
+		ksh_u32char ch;
+		int len;
+		if (sample[i] == '\n' || sample[i] == 0) {
+			ch = 0;
+			len = 1;
+		} else {
+			// the sample can end in the middle of a character
+			len = utf8_readcharacter_len(&ch, &sample[i], samplelen - i);
+			if (len < 0) {
+				i++;
+				continue;
+			}
+		}
+		i += len;
+		uint32_t hash = fnv_32a(name, 4*sizeof(ksh_u32char)) | 1;
+		size_t slot = hash & (setsize-1);
+		while (set[slot] && set[slot] != hash)
+			slot = (slot+1) & (setsize-1);
+		if (!set[slot]) {
+			set[slot] = hash;
+			distinct++;
+		}
+		if (ch == 0) {
+			memset(name, 0, sizeof(name));
+		} else {
+			memmove(&name[0], &name[1], 3*sizeof(ksh_u32char));
+			name[3] = ch;
+		}
+	}
+	free(set);
+	if (samplelen == 0 || totalsize <= samplelen)
+		return distinct;
+	double beta = 1.0;
+	if (halfdistinct > 0 && distinct > halfdistinct)
+		beta = log2((double)distinct / halfdistinct);
+	if (beta < 0.3)
+		beta = 0.3;
+	if (beta > 1.0)
+		beta = 1.0;
+	return distinct * pow((double)totalsize / samplelen, beta);
+}
+
+/* unsigned leb128:
+ * split the number into groups of 7 bits, starting from the lsb.
+ * then for every 7-bit group, starting from the lsb, set the eighth bit
+ * if there's another group after it, then send that as a byte.
+ * 1234 -> 10011010010 -> 1001 1010010 -> (11010010, 00001001)
+ * dec     bin            4321 7654321     8         8
+ *                       byte2   byte1      [byte1]   [byte2]
+ */
+
+int
+leb128_encode(uint64_t n, unsigned char *buf)
+{
+	int i = 0;
+	do {
+		buf[i] = n & 0x7f;
+		n >>= 7;
+		if (n > 0)
+			buf[i] |= 0x80;
+		i++;
+	} while (n > 0);
+	return i;
+}
+
+int
+leb128_decode(uint64_t *n, unsigned char *buf)
+{
+	int i = 0;
+	*n = 0;
+	while (1) {
+		*n |= (uint64_t)(buf[i] & 0x7F) << (i*7);
+		i++;
+		if (!(buf[i-1] & 0x80))
+			break;
+	}
+	return i;
+}
+
+int
+leb128_decode_bounded(uint64_t *n, unsigned char *buf, unsigned char *end)
+{
+	// for data that wasn't padded, returns -1 instead of going past end
+	// or past the 10 bytes a 64-bit number can take
+	int i = 0;
+	*n = 0;
+	while (1) {
+		if (buf+i >= end || i >= 10)
+			return -1;
+		*n |= (uint64_t)(buf[i] & 0x7F) << (i*7);
+		i++;
+		if (!(buf[i-1] & 0x80))
+			break;
+	}
+	return i;
+}
+
+/*
+ * FILE FORMAT
+ * +- HEADER <l\x05\x01\x04> -> l is lib, 514 is koishi
+ * +- VERSION <\x02> -> starting from 2 because yes, also let's make it leb128
+ * |                    for no reason because no chance this has over 127 versions anyway
+ * +- for each RULE
+ * |  +- RULE.NAME -> 4 or whatever utf-8 chars
+ * |  +- for each CONT in RULE
+ * |  |  +- CONT.CHAR -> utf-8 char
+ * |  |  +- CONT.PROP -> leb128-encoded probability
+ * |  +- RULE END MARKER <\x00\x00> -> looks like a continuation with 0 prop,
+ * |                                   which can't happen naturally and can thus be a marker
+ * +- EOF MARKER <\xFF> -> is not valid utf-8, and can be differentiated from RULE.NAME
+ * Note: RULES and CONTS do not have a specified order
+ *
+ * VERSION 3 (chunked) splits the rules by hash bucket, so chunks can be decoded in parallel
+ * +- HEADER <l\x05\x01\x04>
+ * +- VERSION <\x03>
+ * +- MAPSIZE -> leb128, the mapsize the buckets were computed with
+ * +- NCHUNKS -> leb128
+ * +- for each CHUNK (the index)
+ * |  +- CHUNK.FIRSTBUCKET -> leb128, the chunk has buckets up to the next chunk's first one
+ * |  +- CHUNK.LENGTH -> leb128, in bytes
+ * +- for each CHUNK
+ *    +- RULEs and EOF MARKER, exactly like in version 2
+ *
+ * VERSION 4 (packed) sorts the rules by name, so the names and continuations
+ * can be stored as differences, and optionally compresses the whole thing
+ * +- HEADER <l\x05\x01\x04>
+ * +- VERSION <\x04>
+ * +- FLAGS -> leb128, 1 if compressed
+ * +- if compressed, for each BLOCK of up to 1 MiB of the rest
+ * |  +- BLOCK.RAWLEN -> leb128, the size once decompressed, 0 after the last block
+ * |  +- BLOCK.COMPLEN -> leb128, 0 if the block is stored as it is
+ * |  +- the block, see lz_compress
+ * +- NRULES -> leb128
+ * +- for each RULE, in order of the names
+ *    +- RULE.SHARED + RULE.NCONTS -> 1 byte, the low 2 bits are how many codepoints of the
+ *    |                                name are the same as in the previous rule, the rest
+ *    |                                the number of CONTs, or 63 if there's more of them
+ *    +- if there's 63 CONTs or more, RULE.NCONTS minus 63 -> leb128
+ *    +- RULE.NAME -> the first different codepoint minus the same one of the previous
+ *    |               name, then the rest of it, all leb128
+ *    +- for each CONT, in order of the characters
+ *       +- CONT.CHARDELTA -> leb128, minus the previous character (or 0)
+ *       +- CONT.PROP -> leb128
+ */
+void
+save_name(ksh_u32char *name, FILE *f)
+{
+	char buf[4];
+	for (int i = 0; i < 4; i++) { // RULE.NAME
+		int l = utf8_writecharacter(name[i], buf);
+		fwrite(buf, sizeof(char), l, f);
+	}
+}
+
+void
+save_cont(ksh_u32char ch, uint32_t prob, FILE *f)
+{
+	char buf[10]; // longest possible leb128 repr is 10 bytes for 64 bits
+	int l = utf8_writecharacter(ch, buf); // CONT.CHAR
+	fwrite(buf, sizeof(char), l, f);
+	l = leb128_encode(prob, buf); // CONT.PROP
+	fwrite(buf, sizeof(char), l, f);
+}
+
+void
+save_bucket(ksh_model_t *model, ksh_frozen_t *fz, uint64_t b, FILE *f)
+{
+	// writes every RULE from one bucket, from fz if given or the hashmap otherwise
+	if (fz) {
+		ksh_frozenrule_t *rules = FROZEN_RULES(fz);
+		for (uint32_t i = FROZEN_BUCKETS(fz)[b]; i < FROZEN_BUCKETS(fz)[b+1]; i++) { // for each RULE
+			save_name(rules[i].name, f);
+			for (uint32_t j = rules[i].first; j < rules[i].first + rules[i].count; j++) // for each CONT in RULE
+				save_cont(FROZEN_CHARS(fz)[j], FROZEN_PROBS(fz)[j], f);
+			fwrite("\x00\x00", sizeof(char), 2, f); // RULE END MARKER
+		}
+		return;
+	}
+	if (model->bounded)
+		bounded_sync(model, b);
+	for(ksh_rule_t *rule = model->hashmap[b]; rule != NULL; rule = rule->next) { // for each RULE
+		save_name(rule->name, f);
+		for (int i = 0; i < KSH_CONTINUATIONS_PER_HEADER; i++) { // for each CONT in RULE (1)
+			if (rule->probability[i])
+				save_cont(rule->character[i], rule->probability[i], f);
+		}
+		for(ksh_continuations_t *c = rule->cont; c != NULL; c = c->next) {
+			for (int i = 0; i < KSH_CONTINUATIONS_PER_STRUCT; i++) { // for each CONT in RULE (2)
+				if (c->probability[i])
+					save_cont(c->character[i], c->probability[i], f);
+			}
+		}
+		fwrite("\x00\x00", sizeof(char), 2, f); // RULE END MARKER
+	}
+}
+
+void
+save_frozen(ksh_frozen_t *fz, FILE *f)
+{
+	fwrite("l\x05\x01\x04\x02", sizeof(char), 5, f); // HEADER + VERSION
+	for (uint64_t i = 0; i < (1<<fz->mapsize); i++)
+		save_bucket(NULL, fz, i, f);
+	fwrite("\xFF", sizeof(char), 1, f); // EOF MARKER
+}
+
+void
+ksh_savemodel(ksh_model_t *model, FILE *f)
+{
+	if (model->frozen) {
+		save_frozen(model->frozen, f);
+		return;
+	}
+	if (model->lazy)
+		lazy_materialize(model);
+	fwrite("l\x05\x01\x04\x02", sizeof(char), 5, f); // HEADER + VERSION
+	for (uint64_t i = 0; i < (1<<model->mapsize); i++)
+		save_bucket(model, NULL, i, f);
+	fwrite("\xFF", sizeof(char), 1, f); // EOF MARKER
+}
+
+int
+ksh_savemodel_chunked(ksh_model_t *model, FILE *f, int nchunks)
+{
+	if (model->lazy && lazy_materialize(model) < 0)
+		return -1;
+	int mapsize = model->frozen ? model->frozen->mapsize : model->mapsize;
+	uint64_t nbuckets = 1<<mapsize;
+	if (nchunks < 1)
+		nchunks = 1;
+	if (nchunks > nbuckets)
+		nchunks = nbuckets;
+	// the index needs the chunk lengths, so the chunks are put together in memory first
+	char **chunks = calloc(sizeof(char*), nchunks);
+	size_t *lengths = calloc(sizeof(size_t), nchunks);
+	if (!chunks || !lengths) {
+		free(chunks);
+		free(lengths);
+		return -1;
+	}
+	int ret = 0;
+	for (int c = 0; c < nchunks; c++) {
+		FILE *mf = open_memstream(&chunks[c], &lengths[c]);
+		if (!mf) {
+			ret = -1;
+			break;
+		}
+		for (uint64_t b = nbuckets*c/nchunks; b < nbuckets*(c+1)/nchunks; b++)
+			save_bucket(model, model->frozen, b, mf);
+		fwrite("\xFF", sizeof(char), 1, mf); // EOF MARKER
+		fclose(mf);
+	}
+	if (ret == 0) {
+		unsigned char buf[10];
+		fwrite("l\x05\x01\x04\x03", sizeof(char), 5, f); // HEADER + VERSION
+		fwrite(buf, sizeof(char), leb128_encode(mapsize, buf), f); // MAPSIZE
+		fwrite(buf, sizeof(char), leb128_encode(nchunks, buf), f); // NCHUNKS
+		for (int c = 0; c < nchunks; c++) {
+			fwrite(buf, sizeof(char), leb128_encode(nbuckets*c/nchunks, buf), f); // CHUNK.FIRSTBUCKET
+			fwrite(buf, sizeof(char), leb128_encode(lengths[c], buf), f); // CHUNK.LENGTH
+		}
+		for (int c = 0; c < nchunks; c++)
+			fwrite(chunks[c], sizeof(char), lengths[c], f);
+		if (ferror(f))
+			ret = -1;
+	}
+	for (int c = 0; c < nchunks; c++)
+		free(chunks[c]);
+	free(chunks);
+	free(lengths);
+	return ret;
+}
+
+/*
+ * a small lz77 for version 4 files, no need for another dependency.
+ * a compressed block is a list of sequences:
+ * LITLEN (leb128), that many literal bytes, then MATCHLEN and OFFSET (leb128),
+ * a copy of MATCHLEN bytes from OFFSET bytes back (and it can overlap).
+ * the last sequence is just literals, without a match
+ */
+#define LZ_BLOCK (1<<20)
+#define LZ_HASHBITS 16
+#define LZ_MINMATCH 5 // shorter ones don't pay for their own leb128s
+
+size_t
+lz_compress(const unsigned char *in, size_t n, unsigned char *out, uint32_t *table)
+{
+	// out needs n + 16 bytes, table 2^LZ_HASHBITS zeroed entries (positions + 1)
+	size_t anchor = 0, i = 0, o = 0;
+	while (i + LZ_MINMATCH <= n) {
+		uint32_t v;
+		memcpy(&v, &in[i], sizeof(v));
+		uint32_t h = (v * 2654435761u) >> (32 - LZ_HASHBITS);
+		size_t cand = table[h];
+		table[h] = i + 1;
+		if (cand == 0 || memcmp(&in[cand-1], &in[i], LZ_MINMATCH) != 0) {
+			i++;
+			continue;
+		}
+		cand--;
+		size_t len = LZ_MINMATCH;
+		while (i + len < n && in[cand+len] == in[i+len])
+			len++;
+		if (o + (i - anchor) + 30 > n) // not getting any smaller, better stored as it is
+			return n;
+		o += leb128_encode(i - anchor, &out[o]);
+		memcpy(&out[o], &in[anchor], i - anchor);
+		o += i - anchor;
+		o += leb128_encode(len, &out[o]);
+		o += leb128_encode(i - cand, &out[o]);
+		i += len;
+		anchor = i;
+	}
+	if (anchor < n) {
+		if (o + (n - anchor) + 10 >= n)
+			return n;
+		o += leb128_encode(n - anchor, &out[o]);
+		memcpy(&out[o], &in[anchor], n - anchor);
+		o += n - anchor;
+	}
+	return o;
+}
+
+int
+lz_decompress(const unsigned char *in, size_t n, unsigned char *out, size_t rawlen)
+{
+	// in has to be padded with a few zero bytes, like for parse_rules
+	const unsigned char *end = in + n;
+	size_t o = 0;
+	while (o < rawlen) {
+		uint64_t lit, len, off;
+		in += leb128_decode(&lit, (unsigned char*)in);
+		if (in > end || lit > rawlen - o || lit > end - in)
+			return -1;
+		memcpy(&out[o], in, lit);
+		in += lit;
+		o += lit;
+		if (o == rawlen)
+			break;
+		in += leb128_decode(&len, (unsigned char*)in);
+		in += leb128_decode(&off, (unsigned char*)in);
+		if (in > end || off == 0 || off > o || len > rawlen - o)
+			return -1;
+		for (uint64_t i = 0; i < len; i++, o++)
+			out[o] = out[o - off];
+	}
+	return 0;
+}
+
+#define PACKED_MANY 63 // RULE.NCONTS that doesn't fit in the byte with RULE.SHARED
+
+struct packedrule {
+	const ksh_u32char *name;
+	ksh_rule_t *rule; // NULL if it's a frozen one
+	uint32_t index;
+};
+
+int
+packedrule_cmp(const void *a, const void *b)
+{
+	const ksh_u32char *x = ((struct packedrule*)a)->name, *y = ((struct packedrule*)b)->name;
+	for (int i = 0; i < 4; i++) {
+		if (x[i] != y[i])
+			return x[i] < y[i] ? -1 : 1;
+	}
+	return 0;
+}
+
+int
+packedcont_cmp(const void *a, const void *b)
+{
+	ksh_u32char x = *(ksh_u32char*)a, y = *(ksh_u32char*)b;
+	return x < y ? -1 : x > y;
+}
+
+int
+save_packed_rules(ksh_model_t *model, FILE *f)
+{
+	// the uncompressed part of a version 4 file, from NRULES on
+	ksh_frozen_t *fz = model->frozen;
+	uint64_t n = fz ? fz->nrules : model->nrules;
+	struct packedrule *rules = malloc((n ? n : 1) * sizeof(struct packedrule));
+	if (!rules)
+		return -1;
+	uint64_t maxconts = 0;
+	if (fz) {
+		for (uint32_t i = 0; i < fz->nrules; i++) {
+			rules[i] = (struct packedrule){FROZEN_RULES(fz)[i].name, NULL, i};
+			if (FROZEN_RULES(fz)[i].count > maxconts)
+				maxconts = FROZEN_RULES(fz)[i].count;
+		}
+	} else {
+		uint64_t r = 0;
+		for (uint64_t b = 0; b < ((uint64_t)1 << model->mapsize); b++) {
+			if (model->bounded)
+				bounded_sync(model, b);
+			for (ksh_rule_t *rule = model->hashmap[b]; rule != NULL; rule = rule->next) {
+				rules[r++] = (struct packedrule){rule->name, rule, 0};
+				uint64_t count = 0;
+				struct cont c = {.ptr=0, .i=-1};
+				while (cont_next(rule, &c))
+					count++;
+				if (count > maxconts)
+					maxconts = count;
+			}
+		}
+		n = r;
+	}
+	qsort(rules, n, sizeof(struct packedrule), packedrule_cmp);
+	uint32_t (*conts)[2] = malloc((maxconts ? maxconts : 1) * sizeof(*conts)); // character, probability
+	if (!conts) {
+		free(rules);
+		return -1;
+	}
+	unsigned char buf[10];
+	fwrite(buf, sizeof(char), leb128_encode(n, buf), f); // NRULES
+	const ksh_u32char zero[4] = {0};
+	for (uint64_t i = 0; i < n; i++) {
+		const ksh_u32char *name = rules[i].name, *prev = i ? rules[i-1].name : zero;
+		int shared = 0;
+		if (i > 0) {
+			while (shared < 3 && name[shared] == prev[shared])
+				shared++;
+		}
+		uint64_t count = 0;
+		if (rules[i].rule) {
+			struct cont c = {.ptr=0, .i=-1};
+			while (cont_next(rules[i].rule, &c)) {
+				if (*cont_prob(rules[i].rule, &c)) {
+					conts[count][0] = *cont_char(rules[i].rule, &c);
+					conts[count++][1] = *cont_prob(rules[i].rule, &c);
+				}
+			}
+		} else {
+			ksh_frozenrule_t *fr = &FROZEN_RULES(fz)[rules[i].index];
+			for (uint32_t j = fr->first; j < fr->first + fr->count; j++) {
+				conts[count][0] = FROZEN_CHARS(fz)[j];
+				conts[count++][1] = FROZEN_PROBS(fz)[j];
+			}
+		}
+		qsort(conts, count, sizeof(*conts), packedcont_cmp);
+		fputc(shared | (count < PACKED_MANY ? count : PACKED_MANY) << 2, f); // RULE.SHARED + RULE.NCONTS
+		if (count >= PACKED_MANY)
+			fwrite(buf, sizeof(char), leb128_encode(count - PACKED_MANY, buf), f);
+		fwrite(buf, sizeof(char), leb128_encode(name[shared] - prev[shared], buf), f); // RULE.NAME
+		for (int j = shared+1; j < 4; j++)
+			fwrite(buf, sizeof(char), leb128_encode(name[j], buf), f);
+		ksh_u32char last = 0;
+		for (uint64_t j = 0; j < count; j++) {
+			fwrite(buf, sizeof(char), leb128_encode(conts[j][0] - last, buf), f); // CONT.CHARDELTA
+			fwrite(buf, sizeof(char), leb128_encode(conts[j][1], buf), f); // CONT.PROP
+			last = conts[j][0];
+		}
+	}
+	free(conts);
+	free(rules);
+	return 0;
+}
+
+int
+ksh_savemodel_packed(ksh_model_t *model, FILE *f, int compress)
+{
+	if (model->lazy && lazy_materialize(model) < 0)
+		return -1;
+	unsigned char buf[10];
+	fwrite("l\x05\x01\x04\x04", sizeof(char), 5, f); // HEADER + VERSION
+	fwrite(buf, sizeof(char), leb128_encode(compress ? 1 : 0, buf), f); // FLAGS
+	if (!compress)
+		return save_packed_rules(model, f) < 0 || ferror(f) ? -1 : 0;
+	char *data = NULL;
+	size_t len = 0;
+	FILE *mf = open_memstream(&data, &len);
+	if (!mf)
+		return -1;
+	int ret = save_packed_rules(model, mf);
+	fclose(mf);
+	unsigned char *out = malloc(LZ_BLOCK + 16);
+	uint32_t *table = malloc(sizeof(uint32_t) << LZ_HASHBITS);
+	if (ret < 0 || !out || !table) {
+		free(data);
+		free(out);
+		free(table);
+		return -1;
+	}
+	for (size_t pos = 0; pos < len; pos += LZ_BLOCK) {
+		size_t rawlen = len - pos < LZ_BLOCK ? len - pos : LZ_BLOCK;
+		memset(table, 0, sizeof(uint32_t) << LZ_HASHBITS);
+		size_t complen = lz_compress((unsigned char*)&data[pos], rawlen, out, table);
+		fwrite(buf, sizeof(char), leb128_encode(rawlen, buf), f); // BLOCK.RAWLEN
+		if (complen >= rawlen) {
+			fwrite(buf, sizeof(char), leb128_encode(0, buf), f); // BLOCK.COMPLEN, stored
+			fwrite(&data[pos], sizeof(char), rawlen, f);
+		} else {
+			fwrite(buf, sizeof(char), leb128_encode(complen, buf), f); // BLOCK.COMPLEN
+			fwrite(out, sizeof(char), complen, f);
+		}
+	}
+	fwrite(buf, sizeof(char), leb128_encode(0, buf), f); // BLOCK.RAWLEN, the end
+	free(data);
+	free(out);
+	free(table);
+	return ferror(f) ? -1 : 0;
+}
+
+struct ksh_savejob_t {
+	pthread_t thread;
+	ksh_frozen_t *snapshot;
+	FILE *f;
+	void (*done)(int, void*);
+	void *userdata;
+	int status;
+};
+
+void*
+savejob_run(void *arg)
+{
+	ksh_savejob_t *job = arg;
+	save_frozen(job->snapshot, job->f);
+	int status = (fflush(job->f) != 0 || ferror(job->f)) ? -1 : 0;
+	placed_free(job->snapshot);
+	job->snapshot = NULL;
+	__atomic_store_n(&job->status, status, __ATOMIC_RELEASE);
+	if (job->done)
+		job->done(status, job->userdata);
+	return NULL;
+}
+
+ksh_savejob_t*
+ksh_savemodel_async(ksh_model_t *model, FILE *f, void (*done)(int status, void *userdata), void *userdata)
+{
+	ksh_savejob_t *job = malloc(sizeof(ksh_savejob_t));
+	if (!job)
+		return NULL;
+	// the frozen form doubles as the snapshot. a frozen model gets copied too,
+	// since training would thaw (and free) it under the writer's feet. the
+	// writer never follows links, so neither copy has them
+	if (model->frozen) {
+		uint64_t size = model->frozen->linkoff;
+		job->snapshot = placed_alloc(size, 0, 0);
+		if (job->snapshot) {
+			memcpy(job->snapshot, model->frozen, size);
+			job->snapshot->size = size;
+		}
+	} else {
+		job->snapshot = frozen_build(model, 0);
+	}
+	if (!job->snapshot) {
+		free(job);
+		return NULL;
+	}
+	job->f = f;
+	job->done = done;
+	job->userdata = userdata;
+	job->status = KSH_SAVE_RUNNING;
+	if (pthread_create(&job->thread, NULL, savejob_run, job) != 0) {
+		placed_free(job->snapshot);
+		free(job);
+		return NULL;
+	}
+	return job;
+}
+
+int
+ksh_savejob_status(ksh_savejob_t *job)
+{
+	return __atomic_load_n(&job->status, __ATOMIC_ACQUIRE);
+}
+
+int
+ksh_savejob_wait(ksh_savejob_t *job)
+{
+	pthread_join(job->thread, NULL);
+	int status = job->status;
+	free(job);
+	return status;
+}
+
+/*
+ * bulk building. training looks up (or creates) a rule for every single
+ * character, which is the slowest possible way of counting when the whole
+ * corpus is known up front. instead, every (name, character) pair gets written
+ * out into a flat array, the array is radix sorted so that equal pairs end up
+ * next to each other, runs of them are added up into counts, and the rules
+ * are then written out one after another, each with all of its continuations.
+ * to keep the sort short, the codepoints that actually appear are numbered
+ * first, and the five of them in a pair are packed into one key with just
+ * enough bits for those numbers
+ */
+#define ALPHABET_CHARS 0x200000 // utf8_readcharacter can decode up to 21 bits
+
+struct alphabet {
+	uint64_t present[ALPHABET_CHARS/64]; // bitmap of the codepoints used
+	uint32_t rank[ALPHABET_CHARS/64]; // id of the first used codepoint in each word of it
+	ksh_u32char *chars; // the codepoint for every id
+	uint32_t size;
+	int width; // bits per id
+};
+
+struct ngram {
+	uint32_t key[4]; // the name and character as ids, name[0] in the most significant bits
+	uint32_t bucket; // sorted on after the key
+	uint32_t count;
+};
+#define NGRAM_BUCKET_DIGIT 16 // digits (bytes) are numbered from the least significant one of key
+
+static inline void
+alphabet_add(struct alphabet *a, ksh_u32char ch)
+{
+	a->present[ch>>6] |= (uint64_t)1 << (ch&63);
+}
+
+void
+alphabet_scan(struct alphabet *a, const char *str)
+{
+	alphabet_add(a, 0); // the padding of the names, and the end of the string
+	ksh_u32char ch;
+	for (int i = 0; str[i] != 0; ) {
+		int len = utf8_readcharacter(&ch, &str[i]);
+		if (len < 0) {
+			i++;
+			continue;
+		}
+		i += len;
+		alphabet_add(a, ch);
+	}
+}
+
+int
+alphabet_finish(struct alphabet *a)
+{
+	// numbers the codepoints in order, so sorting by ids sorts by codepoints too
+	uint32_t size = 0;
+	for (uint32_t w = 0; w < ALPHABET_CHARS/64; w++) {
+		a->rank[w] = size;
+		size += __builtin_popcountll(a->present[w]);
+	}
+	a->chars = malloc(size * sizeof(ksh_u32char));
+	if (!a->chars)
+		return -1;
+	uint32_t id = 0;
+	for (uint32_t w = 0; w < ALPHABET_CHARS/64; w++) {
+		for (uint64_t bits = a->present[w]; bits; bits &= bits-1)
+			a->chars[id++] = w*64 + __builtin_ctzll(bits);
+	}
+	a->size = size;
+	a->width = 1;
+	while (((uint32_t)1 << a->width) < size)
+		a->width++;
+	return 0;
+}
+
+static inline uint32_t
+alphabet_id(struct alphabet *a, ksh_u32char ch)
+{
+	uint64_t below = a->present[ch>>6] & (((uint64_t)1 << (ch&63)) - 1);
+	return a->rank[ch>>6] + __builtin_popcountll(below);
+}
+
+static inline unsigned __int128
+ngram_getkey(struct ngram *g)
+{
+	unsigned __int128 k;
+	memcpy(&k, g->key, sizeof(k));
+	return k;
+}
+
+void
+ngram_unpack(struct alphabet *a, struct ngram *g, ksh_u32char *name, ksh_u32char *ch)
+{
+	unsigned __int128 k = ngram_getkey(g);
+	uint32_t mask = ((uint32_t)1 << a->width) - 1;
+	*ch = a->chars[k & mask];
+	for (int i = 3; i >= 0; i--) {
+		k >>= a->width;
+		name[i] = a->chars[k & mask];
+	}
+}
+
+size_t
+ngram_extract(struct alphabet *a, const char *str, struct ngram *out)
+{
+	// writes a pair for every character of str and the end of it, same as
+	// ksh_trainmarkov would train, and returns how many. that's at most strlen+1
+	size_t n = 0;
+	int w = a->width;
+	unsigned __int128 namemask = ((unsigned __int128)1 << 4*w) - 1;
+	unsigned __int128 name = 0; // all id 0, which is always codepoint 0
+	ksh_u32char ch = 0;
+	int i = 0;
+	while (1) {
+		if (str[i] == 0) {
+			ch = 0;
+		} else {
+			int len = utf8_readcharacter(&ch, &str[i]);
+			if (len < 0) {
+				i++;
+				continue;
+			}
+			i += len;
+		}
+		unsigned __int128 k = name << w | alphabet_id(a, ch);
+		memcpy(out[n].key, &k, sizeof(k));
+		out[n].bucket = 0;
+		out[n].count = 1;
+		n++;
+		if (ch == 0)
+			break;
+		name = k & namemask;
+	}
+	return n;
+}
+
+struct ngram*
+ngram_sort(struct ngram *a, struct ngram *tmp, size_t n, int firstdigit, int ndigits)
+{
+	// lsd radix sort on ndigits bytes of key/bucket, starting from firstdigit.
+	// all the histograms are counted in one go up front, and bytes that are
+	// the same in every pair get skipped entirely. returns a or tmp,
+	// whichever the result ended up in
+	size_t (*hist)[256] = calloc(ndigits, sizeof(*hist));
+	if (!hist)
+		return NULL;
+	for (size_t i = 0; i < n; i++) {
+		unsigned char *digits = (unsigned char*)&a[i] + firstdigit;
+		for (int d = 0; d < ndigits; d++)
+			hist[d][digits[d]]++;
+	}
+	for (int d = 0; d < ndigits; d++) {
+		size_t pos = 0;
+		int trivial = 0;
+		for (int b = 0; b < 256; b++) {
+			size_t c = hist[d][b];
+			if (c == n)
+				trivial = 1;
+			hist[d][b] = pos;
+			pos += c;
+		}
+		if (trivial)
+			continue;
+		for (size_t i = 0; i < n; i++) {
+			unsigned char digit = ((unsigned char*)&a[i])[firstdigit + d];
+			tmp[hist[d][digit]++] = a[i];
+		}
+		struct ngram *swap = a;
+		a = tmp;
+		tmp = swap;
+	}
+	free(hist);
+	return a;
+}
+
+size_t
+ngram_reduce(struct ngram *a, size_t n)
+{
+	// adds up runs of equal pairs in a sorted array, in place
+	if (n == 0)
+		return 0;
+	size_t out = 0;
+	for (size_t i = 1; i < n; i++) {
+		if (0 == memcmp(a[out].key, a[i].key, sizeof(a[i].key))) {
+			uint32_t add = a[i].count;
+			if (a[out].count > UINT32_MAX - add)
+				add = UINT32_MAX - a[out].count;
+			a[out].count += add;
+		} else {
+			a[++out] = a[i];
+		}
+	}
+	return out+1;
+}
+
+size_t
+ngram_rule_end(struct alphabet *al, struct ngram *a, size_t i, size_t n)
+{
+	// the end of the run of pairs belonging to the same rule as a[i]
+	unsigned __int128 name = ngram_getkey(&a[i]) >> al->width;
+	size_t j = i+1;
+	while (j < n && ngram_getkey(&a[j]) >> al->width == name)
+		j++;
+	return j;
+}
+
+int
+ngram_emit(ksh_model_t *model, struct alphabet *al, struct ngram *a, size_t n)
+{
+	// adds sorted and reduced pairs (with their buckets filled in) to the model
+	ksh_u32char name[4], ch;
+	for (size_t i = 0; i < n; ) {
+		size_t end = ngram_rule_end(al, a, i, n);
+		ngram_unpack(al, &a[i], name, &ch);
+		ksh_rule_t *rule = find_rule(model, name, a[i].bucket);
+		if (rule) { // merging into what was there already
+			for (; i < end; i++) {
+				ngram_unpack(al, &a[i], name, &ch);
+				if (associate(model, rule, ch, a[i].count) < 0)
+					return -1;
+			}
+			continue;
+		}
+		rule = create_rule(model, name, &a[i].bucket);
+		if (!rule)
+			return -1;
+		struct cont c = {.ptr=0, .i=-1};
+		for (; i < end; i++) {
+			ngram_unpack(al, &a[i], name, &ch);
+			if (append_cont(model, rule, &c) < 0)
+				return -1;
+			if (c.ptr) {
+				c.ptr->character[c.i] = ch;
+				c.ptr->probability[c.i] = a[i].count;
+			} else {
+				rule->character[c.i] = ch;
+				rule->probability[c.i] = a[i].count;
+			}
+			rule->probtotal += a[i].count;
+		}
+	}
+	return 0;
+}
+
+void
+ngram_save(struct alphabet *al, struct ngram *a, size_t n, FILE *f)
+{
+	// writes sorted and reduced pairs as RULEs
+	ksh_u32char name[4], ch;
+	for (size_t i = 0; i < n; ) {
+		size_t end = ngram_rule_end(al, a, i, n);
+		ngram_unpack(al, &a[i], name, &ch);
+		save_name(name, f);
+		for (; i < end; i++) {
+			ngram_unpack(al, &a[i], name, &ch);
+			save_cont(ch, a[i].count, f);
+		}
+		fwrite("\x00\x00", sizeof(char), 2, f); // RULE END MARKER
+	}
+}
+
+struct ngram*
+ngram_collect(struct alphabet *al, const char **strings, size_t n, size_t *count)
+{
+	// extracts, sorts by name and reduces the pairs from all the strings.
+	// al has to be zeroed, and its chars freed afterwards
+	size_t cap = 1;
+	for (size_t i = 0; i < n; i++) {
+		alphabet_scan(al, strings[i]);
+		cap += strlen(strings[i]) + 1;
+	}
+	if (alphabet_finish(al) < 0)
+		return NULL;
+	struct ngram *a = malloc(cap * sizeof(struct ngram));
+	struct ngram *tmp = malloc(cap * sizeof(struct ngram));
+	if (!a || !tmp) {
+		free(a);
+		free(tmp);
+		return NULL;
+	}
+	size_t len = 0;
+	for (size_t i = 0; i < n; i++)
+		len += ngram_extract(al, strings[i], &a[len]);
+	struct ngram *sorted = ngram_sort(a, tmp, len, 0, (5*al->width + 7) / 8);
+	if (!sorted) {
+		free(a);
+		free(tmp);
+		return NULL;
+	}
+	free(sorted == a ? tmp : a);
+	*count = ngram_reduce(sorted, len);
+	return sorted;
+}
+
+int
+ksh_bulkbuild(ksh_model_t *model, const char **strings, size_t n)
+{
+	if (model->frozen && ksh_thawmodel(model) < 0)
+		return -1;
+	if (model->lazy && lazy_materialize(model) < 0)
+		return -1;
+	struct alphabet *al = calloc(1, sizeof(struct alphabet));
+	if (!al)
+		return -1;
+	size_t len;
+	struct ngram *a = ngram_collect(al, strings, n, &len);
+	struct ngram *tmp = NULL;
+	if (!a)
+		goto fail;
+	if (model->seen) {
+		for (size_t i = 0; i < n; i++)
+			seen_check(model, record_hash(strings[i], SIZE_MAX), 1);
+	}
+	// now that the number of distinct rules is known, the hashmap can be
+	// sized for them before any bucket gets computed
+	uint64_t names = 0;
+	for (size_t i = 0; i < len; i = ngram_rule_end(al, a, i, len))
+		names++;
+	if (ksh_reserve(model, model->nrules + names) < 0)
+		goto fail;
+	for (size_t i = 0; i < len; ) {
+		size_t end = ngram_rule_end(al, a, i, len);
+		ksh_u32char name[4], ch;
+		ngram_unpack(al, &a[i], name, &ch);
+		uint32_t hash = fnv_32a_folded(name, 4*sizeof(ksh_u32char), model->mapsize);
+		for (; i < end; i++)
+			a[i].bucket = hash;
+	}
+	// sorting on just the bucket keeps the name order within buckets (lsd sorts are stable)
+	tmp = malloc((len ? len : 1) * sizeof(struct ngram));
+	struct ngram *sorted = tmp ? ngram_sort(a, tmp, len, NGRAM_BUCKET_DIGIT, (model->mapsize + 7) / 8) : NULL;
+	if (!sorted)
+		goto fail;
+	free(sorted == a ? tmp : a);
+	int ret = ngram_emit(model, al, sorted, len);
+	free(sorted);
+	free(al->chars);
+	free(al);
+	return ret;
+fail:
+	free(a);
+	free(tmp);
+	free(al->chars);
+	free(al);
+	return -1;
+}
+
+int
+ksh_bulksave(const char **strings, size_t n, FILE *f)
+{
+	struct alphabet *al = calloc(1, sizeof(struct alphabet));
+	if (!al)
+		return -1;
+	size_t len;
+	struct ngram *a = ngram_collect(al, strings, n, &len);
+	if (a) {
+		fwrite("l\x05\x01\x04\x02", sizeof(char), 5, f); // HEADER + VERSION
+		ngram_save(al, a, len, f);
+		fwrite("\xFF", sizeof(char), 1, f); // EOF MARKER
+	}
+	free(a);
+	free(al->chars);
+	free(al);
+	return !a || ferror(f) ? -1 : 0;
+}
+
+/*
+ * compact models. a lossy read-only form for when even the frozen form is too
+ * big. every codepoint is replaced with its number in the model's alphabet,
+ * and every rule's distribution is rounded to 2^bits units, at least one for
+ * each continuation (the least likely ones are dropped if there's more of them
+ * than units). the rules are sorted by their name packed into one number, and
+ * only the difference to the previous one is stored, together with the number
+ * of continuations, as leb128. every COMPACT_RESTART rules there's a restart
+ * point with the full name, so a lookup bisects those and decodes a few rules.
+ * the continuations are bit-packed (id, cumulative units - 1) pairs, most
+ * likely first, and are sampled right from there
+ */
+#define COMPACT_RESTART 64
+#define KSH_COMPACT_VERSION 1
+
+struct compact_restart {
+	uint64_t name; // packed name of the first rule after the restart
+	uint64_t keypos; // its byte in the key stream
+	uint64_t contbit; // its first continuation's bit in the continuation stream
+};
+
+struct ksh_compact_t {
+	char magic[4]; // l\x05\x01\x04
+	uint32_t version;
+	uint32_t bits; // per cumulative weight
+	uint32_t width; // per codepoint id
+	uint32_t nsymbols;
+	uint32_t nrules;
+	uint32_t nrestarts;
+	uint64_t size; // of the whole allocation
+	uint64_t symoff; // ksh_u32char[nsymbols], the alphabet in order
+	uint64_t restartoff; // struct compact_restart[nrestarts]
+	uint64_t keyoff; // leb128 pairs of (name delta, continuation count)
+	uint64_t contoff; // bit stream, padded with 8 bytes for reading
+};
+
+#define COMPACT_SYMBOLS(_C) ((ksh_u32char*)((char*)(_C) + (_C)->symoff))
+#define COMPACT_RESTARTS(_C) ((struct compact_restart*)((char*)(_C) + (_C)->restartoff))
+#define COMPACT_KEYS(_C) ((unsigned char*)(_C) + (_C)->keyoff)
+#define COMPACT_CONTS(_C) ((unsigned char*)(_C) + (_C)->contoff)
+
+static inline uint32_t
+bits_read(const unsigned char *stream, uint64_t pos, int n)
+{
+	uint64_t word;
+	memcpy(&word, &stream[pos>>3], sizeof(word));
+	return (word >> (pos&7)) & (((uint64_t)1 << n) - 1);
+}
+
+static inline void
+bits_write(unsigned char *stream, uint64_t pos, int n, uint32_t value)
+{
+	// the stream has to be zeroed
+	for (int i = 0; i < n; i++, pos++)
+		stream[pos>>3] |= ((value >> i) & 1) << (pos&7);
+}
+
+struct compact_cont {
+	ksh_u32char ch;
+	uint32_t prob;
+	uint32_t units;
+	double rem;
+};
+
+int
+compact_byprob(const void *a, const void *b)
+{
+	const struct compact_cont *x = a, *y = b;
+	return x->prob != y->prob ? (x->prob < y->prob ? 1 : -1) : (x->ch < y->ch ? -1 : x->ch > y->ch);
+}
+
+int
+compact_byrem(const void *a, const void *b)
+{
+	const struct compact_cont *x = a, *y = b;
+	return x->rem != y->rem ? (x->rem < y->rem ? 1 : -1) : compact_byprob(a, b);
+}
+
+int
+compact_quantize(struct compact_cont *conts, int n, int bits, double *kl, double *dropped)
+{
+	// rounds the distribution to 2^bits units, largest remainder first, and
+	// returns how many continuations are kept. kl gets the divergence of the
+	// result from the kept ones, dropped the probability of the rest
+	*kl = *dropped = 0;
+	if (n == 0)
+		return 0;
+	uint32_t units = (uint32_t)1 << bits;
+	qsort(conts, n, sizeof(struct compact_cont), compact_byprob);
+	int keep = n < units ? n : units;
+	double total = 0, kept = 0;
+	for (int i = 0; i < n; i++) {
+		total += conts[i].prob;
+		if (i < keep)
+			kept += conts[i].prob;
+	}
+	uint32_t left = units - keep; // everyone gets one unit for free
+	uint32_t given = 0;
+	for (int i = 0; i < keep; i++) {
+		double share = conts[i].prob / kept * left;
+		conts[i].units = 1 + (uint32_t)share;
+		conts[i].rem = share - (uint32_t)share;
+		given += conts[i].units;
+	}
+	if (given < units) {
+		qsort(conts, keep, sizeof(struct compact_cont), compact_byrem);
+		for (int i = 0; given < units; i = (i+1) % keep, given++)
+			conts[i].units++;
+		qsort(conts, keep, sizeof(struct compact_cont), compact_byprob);
+	}
+	for (int i = 0; i < keep; i++) {
+		double p = conts[i].prob / kept;
+		*kl += p * log(p / ((double)conts[i].units / units));
+	}
+	*dropped = (total - kept) / total;
+	return keep;
+}
+
+uint32_t
+compact_id(ksh_compact_t *c, ksh_u32char ch)
+{
+	// the id of ch, or KSH_NOLINK if it's not in the alphabet
+	ksh_u32char *symbols = COMPACT_SYMBOLS(c);
+	uint32_t lo = 0, hi = c->nsymbols;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (symbols[mid] < ch)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < c->nsymbols && symbols[lo] == ch ? lo : KSH_NOLINK;
+}
+
+int
+compact_find(ksh_compact_t *c, ksh_u32char *name, uint64_t *contbit, uint32_t *count)
+{
+	// finds the rule's continuations, returns 0 if there's no such rule
+	uint64_t key = 0;
+	for (int i = 0; i < 4; i++) {
+		uint32_t id = compact_id(c, name[i]);
+		if (id == KSH_NOLINK)
+			return 0;
+		key = key << c->width | id;
+	}
+	struct compact_restart *restarts = COMPACT_RESTARTS(c);
+	uint32_t lo = 0, hi = c->nrestarts;
+	while (lo < hi) { // the last restart at or before key
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (restarts[mid].name <= key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return 0;
+	struct compact_restart *r = &restarts[lo-1];
+	// ksh_loadcompact walked the whole key stream already, so there's no bounds here
+	unsigned char *keys = COMPACT_KEYS(c);
+	uint64_t pos = r->keypos, bit = r->contbit, cur = r->name;
+	uint32_t end = lo * COMPACT_RESTART < c->nrules ? lo * COMPACT_RESTART : c->nrules;
+	for (uint32_t i = (lo-1) * COMPACT_RESTART; i < end; i++) {
+		uint64_t delta, n;
+		pos += leb128_decode(&delta, &keys[pos]);
+		pos += leb128_decode(&n, &keys[pos]);
+		cur += delta;
+		if (cur == key) {
+			*contbit = bit;
+			*count = n;
+			return 1;
+		}
+		if (cur > key)
+			return 0;
+		bit += n * (c->width + c->bits);
+	}
+	return 0;
+}
+
+ksh_compact_t*
+ksh_compactmodel(ksh_model_t *model, int bits, double *kl, double *dropped)
+{
+	if (bits < 1 || bits > 16 || model->base)
+		return NULL;
+	if (model->frozen) {
+		ksh_model_t *copy = thawed_copy(model);
+		if (!copy)
+			return NULL;
+		ksh_compact_t *c = ksh_compactmodel(copy, bits, kl, dropped);
+		ksh_freemodel(copy);
+		return c;
+	}
+	if (model->lazy && lazy_materialize(model) < 0)
+		return NULL;
+	ksh_compact_t *c = NULL;
+	struct alphabet *al = calloc(1, sizeof(struct alphabet));
+	ksh_rule_t **sorted = malloc((model->nrules ? model->nrules : 1) * sizeof(ksh_rule_t*));
+	struct compact_cont *conts = NULL;
+	unsigned char *keys = NULL, *stream = NULL;
+	if (!al || !sorted || model->nrules >= KSH_NOLINK)
+		goto compact_end;
+	uint64_t n = 0, nconts = 0, maxconts = 0;
+	alphabet_add(al, 0);
+	for (uint64_t b = 0; b < ((uint64_t)1 << model->mapsize); b++) {
+		if (model->bounded)
+			bounded_sync(model, b);
+		for (ksh_rule_t *rule = model->hashmap[b]; rule != NULL; rule = rule->next) {
+			sorted[n++] = rule;
+			for (int i = 0; i < 4; i++)
+				alphabet_add(al, rule->name[i]);
+			uint64_t count = 0;
+			struct cont ct = {.ptr=0, .i=-1};
+			while (cont_next(rule, &ct)) {
+				if (*cont_prob(rule, &ct)) {
+					alphabet_add(al, *cont_char(rule, &ct));
+					count++;
+				}
+			}
+			nconts += count;
+			if (count > maxconts)
+				maxconts = count;
+		}
+	}
+	if (alphabet_finish(al) < 0 || al->width > 16) // the names have to fit 64 bits
+		goto compact_end;
+	qsort(sorted, n, sizeof(ksh_rule_t*), trie_namecmp);
+	int contbits = al->width + bits;
+	conts = malloc((maxconts ? maxconts : 1) * sizeof(struct compact_cont));
+	keys = malloc(n * 2*10 + 1);
+	stream = calloc(1, (nconts * contbits + 7) / 8 + 8);
+	if (!conts || !keys || !stream)
+		goto compact_end;
+	uint32_t nrestarts = (n + COMPACT_RESTART-1) / COMPACT_RESTART;
+	struct compact_restart *restarts = malloc((nrestarts ? nrestarts : 1) * sizeof(struct compact_restart));
+	if (!restarts)
+		goto compact_end;
+	uint64_t keylen = 0, bit = 0, prev = 0, grandtotal = 0;
+	double klsum = 0, dropsum = 0;
+	for (uint64_t i = 0; i < n; i++) {
+		ksh_rule_t *rule = sorted[i];
+		uint64_t name = 0;
+		for (int j = 0; j < 4; j++)
+			name = name << al->width | alphabet_id(al, rule->name[j]);
+		if (i % COMPACT_RESTART == 0) {
+			restarts[i / COMPACT_RESTART] = (struct compact_restart){name, keylen, bit};
+			prev = name;
+		}
+		int count = 0;
+		struct cont ct = {.ptr=0, .i=-1};
+		while (cont_next(rule, &ct)) {
+			if (*cont_prob(rule, &ct))
+				conts[count++] = (struct compact_cont){.ch = *cont_char(rule, &ct), .prob = *cont_prob(rule, &ct)};
+		}
+		double rulekl, ruledropped;
+		count = compact_quantize(conts, count, bits, &rulekl, &ruledropped);
+		// weighted by how often the rule was used, so it's per generated character
+		klsum += rulekl * rule->probtotal;
+		dropsum += ruledropped * rule->probtotal;
+		grandtotal += rule->probtotal;
+		keylen += leb128_encode(name - prev, &keys[keylen]);
+		keylen += leb128_encode(count, &keys[keylen]);
+		prev = name;
+		uint32_t cumulative = 0;
+		for (int j = 0; j < count; j++) {
+			cumulative += conts[j].units;
+			bits_write(stream, bit, al->width, alphabet_id(al, conts[j].ch));
+			bits_write(stream, bit + al->width, bits, cumulative - 1);
+			bit += contbits;
+		}
+	}
+	if (kl)
+		*kl = grandtotal ? klsum / grandtotal : 0;
+	if (dropped)
+		*dropped = grandtotal ? dropsum / grandtotal : 0;
+
+	ksh_compact_t hdr = {0};
+	memcpy(hdr.magic, "l\x05\x01\x04", 4);
+	hdr.version = KSH_COMPACT_VERSION;
+	hdr.bits = bits;
+	hdr.width = al->width;
+	hdr.nsymbols = al->size;
+	hdr.nrules = n;
+	hdr.nrestarts = nrestarts;
+	hdr.restartoff = sizeof(ksh_compact_t);
+	hdr.symoff = hdr.restartoff + nrestarts * sizeof(struct compact_restart);
+	hdr.keyoff = hdr.symoff + al->size * sizeof(ksh_u32char);
+	hdr.contoff = hdr.keyoff + keylen + 16; // padded for leb128_decode
+	hdr.size = hdr.contoff + (bit + 7) / 8 + 8;
+	c = calloc(1, hdr.size);
+	if (c) {
+		*c = hdr;
+		memcpy(COMPACT_RESTARTS(c), restarts, nrestarts * sizeof(struct compact_restart));
+		memcpy(COMPACT_SYMBOLS(c), al->chars, al->size * sizeof(ksh_u32char));
+		memcpy(COMPACT_KEYS(c), keys, keylen);
+		memcpy(COMPACT_CONTS(c), stream, (bit + 7) / 8);
+	}
+	free(restarts);
+
+	compact_end:
+	if (al)
+		free(al->chars);
+	free(al);
+	free(sorted);
+	free(conts);
+	free(keys);
+	free(stream);
+	return c;
+}
+
+void
+ksh_freecompact(ksh_compact_t *c)
+{
+	free(c);
+}
+
+size_t
+ksh_compactsize(ksh_compact_t *c)
+{
+	return c->size;
+}
+
+ksh_u32char
+ksh_compact_getcontinuation(ksh_model_t *model, ksh_compact_t *c, ksh_u32char *name)
+{
+	uint64_t bit;
+	uint32_t count;
+	if (!compact_find(c, name, &bit, &count))
+		return 0;
+	unsigned char *stream = COMPACT_CONTS(c);
+	uint32_t r = model->rng(model->rngdata, (int64_t)1 << c->bits);
+	for (uint32_t i = 0; i < count; i++, bit += c->width + c->bits) {
+		if (r <= bits_read(stream, bit + c->width, c->bits))
+			return COMPACT_SYMBOLS(c)[bits_read(stream, bit, c->width)];
+	}
+	return 0;
+}
+
+void
+ksh_compact_createstring(ksh_model_t *model, ksh_compact_t *c, char *buf, size_t bufsize)
+{
+	ksh_u32char name[4] = {0};
+	int i = 0;
+	while (i < (bufsize-1)) {
+		ksh_u32char ch = ksh_compact_getcontinuation(model, c, name);
+		if (ch == 0)
+			break;
+		char encoded[4];
+		int len = utf8_writecharacter(ch, encoded);
+		if ((i+len+1) >= bufsize)
+			break;
+		memcpy(&buf[i], encoded, len);
+		i += len;
+		memmove(&name[0], &name[1], 3*sizeof(ksh_u32char));
+		name[3] = ch;
+	}
+	buf[i] = 0;
+}
+
+int
+ksh_savecompact(ksh_compact_t *c, FILE *f)
+{
+	// it's one block without any pointers, so it's written as it is
+	return fwrite(c, 1, c->size, f) == c->size ? 0 : -1;
+}
+
+int
+compact_check(ksh_compact_t *c)
+{
+	// goes through the whole thing once, so that lookups can trust it: the
+	// key stream has to decode to exactly nrules rules and end where the
+	// padding starts, the restarts have to point where the rules actually
+	// are, and every id and bit offset has to stay inside the model
+	ksh_u32char *symbols = COMPACT_SYMBOLS(c);
+	for (uint32_t i = 1; i < c->nsymbols; i++) {
+		if (symbols[i] <= symbols[i-1])
+			return -1; // compact_id bisects them
+	}
+	struct compact_restart *restarts = COMPACT_RESTARTS(c);
+	unsigned char *keys = COMPACT_KEYS(c), *keyend = (unsigned char*)c + c->contoff - 16;
+	unsigned char *stream = COMPACT_CONTS(c);
+	uint64_t streambits = (c->size - c->contoff - 8) * 8;
+	uint64_t contbits = c->width + c->bits, units = (uint64_t)1 << c->bits;
+	uint64_t pos = 0, bit = 0, cur = 0;
+	for (uint32_t i = 0; i < c->nrules; i++) {
+		uint64_t delta, n, start = pos;
+		int l = leb128_decode_bounded(&delta, &keys[pos], keyend);
+		if (l < 0)
+			return -1;
+		pos += l;
+		l = leb128_decode_bounded(&n, &keys[pos], keyend);
+		if (l < 0)
+			return -1;
+		pos += l;
+		if (i % COMPACT_RESTART == 0) {
+			struct compact_restart *r = &restarts[i / COMPACT_RESTART];
+			if (delta || r->keypos != start || r->contbit != bit || (i && r->name <= cur))
+				return -1;
+			cur = r->name; // restarts store the whole name, the delta is 0
+		} else if (delta == 0 || cur + delta < cur) {
+			return -1; // the names go strictly up
+		} else {
+			cur += delta;
+		}
+		for (int j = 0; j < 4; j++) {
+			if (((cur >> (j * c->width)) & (((uint64_t)1 << c->width) - 1)) >= c->nsymbols)
+				return -1;
+		}
+		if (4 * c->width < 64 && cur >> (4 * c->width))
+			return -1;
+		if (n > units || n * contbits > streambits - bit)
+			return -1;
+		for (uint64_t j = 0; j < n; j++, bit += contbits) {
+			if (bits_read(stream, bit, c->width) >= c->nsymbols)
+				return -1;
+		}
+	}
+	if (keys + pos != keyend || (bit + 7) / 8 != c->size - c->contoff - 8)
+		return -1;
+	return 0;
+}
+
+ksh_compact_t*
+ksh_loadcompact(FILE *f)
+{
+	ksh_compact_t hdr;
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1)
+		return NULL;
+	if (memcmp(hdr.magic, "l\x05\x01\x04", 4) || hdr.version != KSH_COMPACT_VERSION)
+		return NULL;
+	if (hdr.bits < 1 || hdr.bits > 16 || hdr.width < 1 || hdr.width > 16 || hdr.size > ((uint64_t)1<<40))
+		return NULL;
+	if (hdr.restartoff != sizeof(hdr)
+		|| hdr.symoff != hdr.restartoff + (uint64_t)hdr.nrestarts * sizeof(struct compact_restart)
+		|| hdr.keyoff != hdr.symoff + (uint64_t)hdr.nsymbols * sizeof(ksh_u32char)
+		|| hdr.contoff < hdr.keyoff + 16 || hdr.size < 8 || hdr.contoff > hdr.size - 8
+		|| hdr.nrestarts != (hdr.nrules + COMPACT_RESTART-1) / COMPACT_RESTART)
+		return NULL;
+	// the buffer grows with what's actually in the file, so a made up size
+	// can't get more than about twice the file allocated
+	size_t len = sizeof(hdr), cap = sizeof(hdr) + (1<<16);
+	ksh_compact_t *c = NULL;
+	while (1) {
+		if (cap > hdr.size)
+			cap = hdr.size;
+		ksh_compact_t *new = realloc(c, cap);
+		if (!new)
+			goto loadcompact_fail;
+		c = new;
+		len += fread((char*)c + len, 1, cap - len, f);
+		if (len < cap)
+			goto loadcompact_fail; // truncated
+		if (len == hdr.size)
+			break;
+		cap *= 2;
+	}
+	*c = hdr;
+	if (compact_check(c) < 0)
+		goto loadcompact_fail;
+	return c;
+
+	loadcompact_fail:
+	free(c);
+	return NULL;
+}
+
+long
+parse_rules(ksh_model_t *model, unsigned char *p, unsigned char *end, uint64_t lo, uint64_t hi)
+{
+	// decodes RULEs from memory up to the EOF MARKER, returns the bytes used or <0.
+	// the buffer has to be padded with a few zero bytes, so that a truncated
+	// character or leb128 at the end stops on them instead of running off.
+	// every rule has to fall into the buckets [lo, hi)
+	unsigned char *start = p;
+	while (1) {
+		if (p >= end)
+			return -1;
+		if (*p == 0xFF) // EOF MARKER
+			return p+1 - start;
+		ksh_u32char name[4];
+		for (int i = 0; i < 4; i++) {
+			int l = utf8_readcharacter(&name[i], (char*)p);
+			if (l < 0)
+				return -1;
+			p += l;
+		}
+		uint32_t hash = fnv_32a_folded(name, 4*sizeof(ksh_u32char), model->mapsize);
+		if (hash < lo || hash >= hi)
+			return -1;
+		ksh_rule_t *rule = create_rule(model, name, &hash);
+		if (!rule)
+			return -1;
+		struct cont c = {.ptr=0, .i=-1};
+		while (1) {
+			ksh_u32char ch;
+			uint64_t prop;
+			int l = utf8_readcharacter(&ch, (char*)p);
+			if (l < 0)
+				return -1;
+			p += l;
+			p += leb128_decode(&prop, p);
+			if (p > end)
+				return -1;
+			if (prop == 0) {
+				if (ch == 0)
+					break; // RULE END MARKER
+				return -10; // prop cannot be 0
+			}
+			rule->probtotal += prop;
+			if (append_cont(model, rule, &c) < 0)
+				return -1;
+			if (c.ptr) {
+				c.ptr->character[c.i] = ch;
+				c.ptr->probability[c.i] = prop;
+			} else {
+				rule->character[c.i] = ch;
+				rule->probability[c.i] = prop;
+			}
+		}
+	}
+}
+
+struct chunkloader {
+	ksh_model_t shadow; // shares the hashmap, but has its own pools
+	unsigned char *data;
+	uint64_t *firsts, *offsets, *lengths;
+	int nchunks;
+	int *nextchunk;
+	int status;
+};
 
-int
-leb128_encode(uint64_t n, unsigned char *buf)
+void*
+chunkloader_run(void *arg)
 {
-	int i = 0;
-	do {
-		buf[i] = n & 0x7f;
-		n >>= 7;
-		if (n > 0)
-			buf[i] |= 0x80;
-		i++;
-	} while (n > 0);
-	return i;
+	struct chunkloader *cl = arg;
+	cl->status = 0;
+	while (1) {
+		int c = __atomic_fetch_add(cl->nextchunk, 1, __ATOMIC_RELAXED);
+		if (c >= cl->nchunks)
+			break;
+		// every chunk covers its own range of buckets, so no locking is needed.
+		// parse_rules makes sure the file doesn't lie about that
+		unsigned char *p = cl->data + cl->offsets[c];
+		if (parse_rules(&cl->shadow, p, p + cl->lengths[c], cl->firsts[c], cl->firsts[c+1]) < 0) {
+			cl->status = -1;
+			break;
+		}
+	}
+	return NULL;
 }
 
 int
-leb128_decode(uint64_t *n, unsigned char *buf)
+load_chunked(ksh_model_t *model, FILE *f, int nthreads)
 {
-	int i = 0;
-	*n = 0;
+	size_t len = 0, cap = 1<<16;
+	unsigned char *data = malloc(cap + 16);
+	if (!data)
+		return -1;
 	while (1) {
-		*n |= (buf[i] & 0x7F) << (i*7);
-		i++;
-		if (!(buf[i-1] & 0x80))
+		len += fread(data+len, sizeof(char), cap-len, f);
+		if (len < cap)
 			break;
+		cap *= 2;
+		unsigned char *new = realloc(data, cap + 16);
+		if (!new) {
+			free(data);
+			return -1;
+		}
+		data = new;
 	}
-	return i;
+	memset(data+len, 0, 16);
+
+	int ret = -1;
+	uint64_t mapsize, nchunks, *firsts = NULL, *offsets = NULL, *lengths = NULL;
+	size_t pos = 0;
+	pos += leb128_decode(&mapsize, data+pos); // MAPSIZE
+	pos += leb128_decode(&nchunks, data+pos); // NCHUNKS
+	if (pos > len || mapsize > 30 || nchunks > ((uint64_t)1<<mapsize))
+		goto load_chunked_end;
+	firsts = calloc(sizeof(uint64_t), nchunks+1); // with an extra entry for the end of the last chunk
+	offsets = calloc(sizeof(uint64_t), nchunks);
+	lengths = calloc(sizeof(uint64_t), nchunks);
+	if (!firsts || !offsets || !lengths)
+		goto load_chunked_end;
+	for (uint64_t c = 0; c < nchunks; c++) {
+		pos += leb128_decode(&firsts[c], data+pos); // CHUNK.FIRSTBUCKET
+		pos += leb128_decode(&lengths[c], data+pos); // CHUNK.LENGTH
+		if (pos > len)
+			goto load_chunked_end;
+		if ((c > 0 && firsts[c] < firsts[c-1]) || firsts[c] >= ((uint64_t)1<<mapsize))
+			goto load_chunked_end;
+	}
+	firsts[0] = 0;
+	firsts[nchunks] = 1<<mapsize;
+	for (uint64_t c = 0; c < nchunks; c++) {
+		offsets[c] = pos;
+		if (lengths[c] > len - pos)
+			goto load_chunked_end;
+		pos += lengths[c];
+	}
+
+	if (nthreads > 1 && model->mapsize != mapsize && model->nrules == 0) {
+		// an empty model can just take over the file's bucket layout
+		ksh_rule_t **hashmap = placed_alloc(sizeof(ksh_rule_t*) << mapsize, model->allocflags, model->allocnode);
+		if (hashmap) {
+			placed_free(model->hashmap);
+			model->hashmap = hashmap;
+			model->mapsize = mapsize;
+		}
+	}
+	if (nthreads <= 1 || model->mapsize != mapsize) {
+		// chunks can't be split between threads, just go through them in order.
+		// with a different mapsize the bucket ranges mean nothing
+		int same = model->mapsize == mapsize;
+		for (uint64_t c = 0; c < nchunks; c++) {
+			uint64_t lo = same ? firsts[c] : 0, hi = same ? firsts[c+1] : (uint64_t)1<<model->mapsize;
+			if (parse_rules(model, data+offsets[c], data+offsets[c]+lengths[c], lo, hi) < 0)
+				goto load_chunked_end;
+		}
+		ret = 0;
+		goto load_chunked_end;
+	}
+
+	if (nthreads > nchunks)
+		nthreads = nchunks;
+	struct chunkloader *loaders = calloc(sizeof(struct chunkloader), nthreads);
+	pthread_t *threads = calloc(sizeof(pthread_t), nthreads);
+	if (!loaders || !threads) {
+		free(loaders);
+		free(threads);
+		goto load_chunked_end;
+	}
+	int nextchunk = 0;
+	int started = 0;
+	for (int t = 0; t < nthreads; t++) {
+		shadow_init(&loaders[t].shadow, model);
+		loaders[t].data = data;
+		loaders[t].firsts = firsts;
+		loaders[t].offsets = offsets;
+		loaders[t].lengths = lengths;
+		loaders[t].nchunks = nchunks;
+		loaders[t].nextchunk = &nextchunk;
+		if (pthread_create(&threads[t], NULL, chunkloader_run, &loaders[t]) != 0)
+			break;
+		started++;
+	}
+	if (started == 0) // couldn't get any threads, so do it here
+		chunkloader_run(&loaders[0]);
+	for (int t = 0; t < started; t++)
+		pthread_join(threads[t], NULL);
+	ret = 0;
+	for (int t = 0; t < (started ? started : 1); t++) {
+		if (loaders[t].status < 0)
+			ret = -1;
+		pool_adopt(&model->rulepool, &loaders[t].shadow.rulepool);
+		pool_adopt(&model->contpool, &loaders[t].shadow.contpool);
+		model->nrules += loaders[t].shadow.nrules;
+	}
+	free(loaders);
+	free(threads);
+
+	load_chunked_end:
+	free(firsts);
+	free(offsets);
+	free(lengths);
+	free(data);
+	return ret;
 }
 
-/*
- * FILE FORMAT
- * +- HEADER <l\x05\x01\x04> -> l is lib, 514 is koishi
- * +- VERSION <\x02> -> starting from 2 because yes, also let's make it leb128
- * |                    for no reason because no chance this has over 127 versions anyway
- * +- for each RULE
- * |  +- RULE.NAME -> 4 or whatever utf-8 chars
- * |  +- for each CONT in RULE
- * |  |  +- CONT.CHAR -> utf-8 char
- * |  |  +- CONT.PROP -> leb128-encoded probability
- * |  +- RULE END MARKER <\x00\x00> -> looks like a continuation with 0 prop,
- * |                                   which can't happen naturally and can thus be a marker
- * +- EOF MARKER <\xFF> -> is not valid utf-8, and can be differentiated from RULE.NAME
- * Note: RULES and CONTS do not have a specified order
- */
-void
-ksh_savemodel(ksh_model_t *model, FILE *f)
+int
+parse_packed_rules(ksh_model_t *model, unsigned char *p, unsigned char *end)
 {
-	fwrite("l\x05\x01\x04\x02", sizeof(char), 5, f); // HEADER + VERSION
-	char buf[10]; // longest possible leb128 repr is 10 bytes for 64 bits
-	int l;
-	for (uint64_t i = 0; i < (1<<model->mapsize); i++) {
-		for(ksh_rule_t *rule = model->hashmap[i]; rule != NULL; rule = rule->next) { // for each RULE
-			for (int i = 0; i < 4; i++) { // RULE.NAME
-				l = utf8_writecharacter(rule->name[i], buf);
-				fwrite(buf, sizeof(char), l, f);
-			}
-			for (int i = 0; i < KSH_CONTINUATIONS_PER_HEADER; i++) { // for each CONT in RULE (1)
-				if (rule->probability[i]) {
-					l = utf8_writecharacter(rule->character[i], buf); // CONT.CHAR
-					fwrite(buf, sizeof(char), l, f);
-					l = leb128_encode(rule->probability[i], buf); // CONT.PROP
-					fwrite(buf, sizeof(char), l, f);
-				}
-			}
-			for(ksh_continuations_t *c = rule->cont; c != NULL; c = c->next) {
-				for (int i = 0; i < KSH_CONTINUATIONS_PER_STRUCT; i++) { // for each CONT in RULE (2)
-					if (c->probability[i]) {
-						l = utf8_writecharacter(c->character[i], buf); // CONT.CHAR
-						fwrite(buf, sizeof(char), l, f);
-						l = leb128_encode(c->probability[i], buf); // CONT.PROP
-						fwrite(buf, sizeof(char), l, f);
-					}
-				}
+	// decodes the rules of a version 4 file, the buffer has to be padded with 16 zero bytes
+	uint64_t n;
+	p += leb128_decode(&n, p);
+	if (p > end || n > (uint64_t)(end - p))
+		return -1; // every rule takes a few bytes at least
+	if (ksh_reserve(model, model->nrules + n) < 0)
+		return -1;
+	ksh_u32char name[4] = {0};
+	for (uint64_t i = 0; i < n; i++) {
+		int shared = *p & 3; // RULE.SHARED + RULE.NCONTS
+		uint64_t count = *p++ >> 2;
+		if (i == 0 && shared != 0)
+			return -1;
+		if (count == PACKED_MANY) {
+			p += leb128_decode(&count, p);
+			count += PACKED_MANY;
+		}
+		uint64_t v;
+		p += leb128_decode(&v, p);
+		name[shared] += v;
+		for (int j = shared+1; j < 4; j++) {
+			p += leb128_decode(&v, p);
+			name[j] = v;
+		}
+		if (p > end || count > (uint64_t)(end - p))
+			return -1;
+		ksh_rule_t *rule = create_rule(model, name, NULL);
+		if (!rule)
+			return -1;
+		struct cont c = {.ptr=0, .i=-1};
+		ksh_u32char ch = 0;
+		for (uint64_t j = 0; j < count; j++) {
+			uint64_t delta, prop;
+			p += leb128_decode(&delta, p); // CONT.CHARDELTA
+			p += leb128_decode(&prop, p); // CONT.PROP
+			if (p > end || prop == 0 || prop > UINT32_MAX)
+				return -1;
+			ch += delta;
+			rule->probtotal += prop;
+			if (append_cont(model, rule, &c) < 0)
+				return -1;
+			if (c.ptr) {
+				c.ptr->character[c.i] = ch;
+				c.ptr->probability[c.i] = prop;
+			} else {
+				rule->character[c.i] = ch;
+				rule->probability[c.i] = prop;
 			}
-			fwrite("\x00\x00", sizeof(char), 2, f); // RULE END MARKER
 		}
 	}
-	fwrite("\xFF", sizeof(char), 1, f); // EOF MARKER
+	return 0;
 }
 
 int
-ksh_loadmodel(ksh_model_t *model, FILE *f)
+load_packed(ksh_model_t *model, FILE *f)
+{
+	// the rest of the file is read in one go, and decompressed in memory
+	size_t len = 0, cap = 1<<16;
+	unsigned char *data = malloc(cap + 16);
+	unsigned char *raw = NULL;
+	int ret = -1;
+	if (!data)
+		return -1;
+	while (1) {
+		len += fread(&data[len], 1, cap - len, f);
+		if (len < cap)
+			break;
+		unsigned char *bigger = realloc(data, cap*2 + 16);
+		if (!bigger)
+			goto load_packed_end;
+		data = bigger;
+		cap *= 2;
+	}
+	memset(&data[len], 0, 16);
+	unsigned char *p = data, *end = data + len;
+	uint64_t flags;
+	p += leb128_decode(&flags, p); // FLAGS
+	if (p > end || flags > 1)
+		goto load_packed_end;
+	if (!(flags & 1)) {
+		ret = parse_packed_rules(model, p, end);
+		goto load_packed_end;
+	}
+	size_t rawlen = 0, rawcap = 0;
+	while (1) {
+		uint64_t blocklen, complen;
+		p += leb128_decode(&blocklen, p); // BLOCK.RAWLEN
+		if (p > end || blocklen > LZ_BLOCK)
+			goto load_packed_end;
+		if (blocklen == 0)
+			break;
+		p += leb128_decode(&complen, p); // BLOCK.COMPLEN
+		uint64_t stored = complen ? complen : blocklen;
+		if (p > end || stored > (uint64_t)(end - p))
+			goto load_packed_end;
+		if (rawlen + blocklen > rawcap) {
+			rawcap = (rawlen + blocklen) * 2;
+			unsigned char *bigger = realloc(raw, rawcap + 16);
+			if (!bigger)
+				goto load_packed_end;
+			raw = bigger;
+		}
+		if (complen == 0)
+			memcpy(&raw[rawlen], p, blocklen);
+		else if (lz_decompress(p, complen, &raw[rawlen], blocklen) < 0)
+			goto load_packed_end;
+		p += stored;
+		rawlen += blocklen;
+	}
+	if (!raw)
+		goto load_packed_end;
+	memset(&raw[rawlen], 0, 16);
+	ret = parse_packed_rules(model, raw, raw + rawlen);
+
+	load_packed_end:
+	free(data);
+	free(raw);
+	return ret;
+}
+
+int
+loadmodel(ksh_model_t *model, FILE *f, int nthreads)
 {
 #define READ_WITH_SEEK(_RWS_BUF, _RWS_SIZE, _RWS_N, _RWS_F) \
 			do { \
@@ -511,8 +4552,16 @@ ksh_loadmodel(ksh_model_t *model, FILE *f)
 	if (l < 0)
 		return -1; // unexpected EOF
 	fseek(f, l-10, SEEK_CUR);
-	if (version != 2)
+	if (version < 2 || version > 4)
+		return -1;
+	if (model->frozen && ksh_thawmodel(model) < 0)
 		return -1;
+	if (model->lazy && lazy_materialize(model) < 0)
+		return -1;
+	if (version == 3)
+		return load_chunked(model, f, nthreads);
+	if (version == 4)
+		return load_packed(model, f);
 
 	while (1) {
 		ksh_u32char name[4];
@@ -530,6 +4579,8 @@ ksh_loadmodel(ksh_model_t *model, FILE *f)
 		}
 		Df("[ldr] rn%4x%4x%4x%4x", name[0], name[1], name[2], name[3]);
 		ksh_rule_t *rule = create_rule(model, name, NULL);
+		if (!rule)
+			return -1;
 		struct cont c = {.ptr=0, .i=-1};
 		while (1) {
 			// read character
@@ -555,7 +4606,8 @@ ksh_loadmodel(ksh_model_t *model, FILE *f)
 				return -10; // prop cannot be 0
 			}
 			rule->probtotal += prop;
-			append_cont(rule, &c);
+			if (append_cont(model, rule, &c) < 0)
+				return -1;
 			if (c.ptr) {
 				c.ptr->character[c.i] = ch;
 				c.ptr->probability[c.i] = prop;
@@ -567,4 +4619,540 @@ ksh_loadmodel(ksh_model_t *model, FILE *f)
 	}
 	loadmodel_eof:
 	return 0;
-}
\ No newline at end of file
+}
+
+int
+ksh_loadmodel(ksh_model_t *model, FILE *f)
+{
+	return loadmodel(model, f, 1);
+}
+
+int
+ksh_loadmodel_parallel(ksh_model_t *model, FILE *f, int nthreads)
+{
+	// only makes a difference for chunked files
+	return loadmodel(model, f, nthreads);
+}
+
+struct ksh_lazy_t {
+	int fd;
+	uint64_t nchunks;
+	uint64_t *firsts, *offsets, *lengths; // firsts has an extra entry for the end of the last chunk
+	uint32_t *bucketchunk; // which chunk every bucket is in
+	uint64_t *lastuse; // 0 when not loaded
+	uint64_t *bytes; // memory taken up by the chunk's rules
+	char *pinned;
+	uint64_t clock;
+	uint64_t resident, maxresident;
+};
+
+int
+lazy_readleb(FILE *f, uint64_t *n)
+{
+	unsigned char buf[10];
+	int i = 0;
+	do {
+		int ch = fgetc(f);
+		if (ch == EOF || i == 10)
+			return -1;
+		buf[i++] = ch;
+	} while (buf[i-1] & 0x80);
+	leb128_decode(n, buf);
+	return 0;
+}
+
+void
+lazy_close(ksh_model_t *model)
+{
+	struct ksh_lazy_t *lz = model->lazy;
+	close(lz->fd);
+	free(lz->firsts);
+	free(lz->offsets);
+	free(lz->lengths);
+	free(lz->bucketchunk);
+	free(lz->lastuse);
+	free(lz->bytes);
+	free(lz->pinned);
+	free(lz);
+	model->lazy = NULL;
+}
+
+uint64_t
+lazy_chunkbytes(ksh_model_t *model, uint64_t c)
+{
+	struct ksh_lazy_t *lz = model->lazy;
+	uint64_t bytes = 0;
+	for (uint64_t b = lz->firsts[c]; b < lz->firsts[c+1]; b++) {
+		for (ksh_rule_t *rule = model->hashmap[b]; rule != NULL; rule = rule->next) {
+			bytes += sizeof(ksh_rule_t);
+			for (ksh_continuations_t *cont = rule->cont; cont != NULL; cont = cont->next)
+				bytes += sizeof(ksh_continuations_t);
+		}
+	}
+	return bytes;
+}
+
+int
+lazy_load(ksh_model_t *model, uint64_t c)
+{
+	struct ksh_lazy_t *lz = model->lazy;
+	unsigned char *data = malloc(lz->lengths[c] + 16);
+	if (!data)
+		return -1;
+	ssize_t n = pread(lz->fd, data, lz->lengths[c], lz->offsets[c]);
+	memset(data + (n > 0 ? n : 0), 0, 16);
+	int ret = -1;
+	// a rule outside the chunk's buckets would never get evicted with it
+	if (n == lz->lengths[c] && parse_rules(model, data, data+n, lz->firsts[c], lz->firsts[c+1]) >= 0)
+		ret = 0;
+	free(data);
+	// marked as loaded even if it failed, there's no point in trying it over and over
+	lz->lastuse[c] = ++lz->clock;
+	lz->bytes[c] = lazy_chunkbytes(model, c);
+	lz->resident += lz->bytes[c];
+	return ret;
+}
+
+void
+lazy_evict(ksh_model_t *model, uint64_t c)
+{
+	struct ksh_lazy_t *lz = model->lazy;
+	for (uint64_t b = lz->firsts[c]; b < lz->firsts[c+1]; b++) {
+		ksh_rule_t *rule = model->hashmap[b];
+		while (rule != NULL) {
+			ksh_rule_t *next = rule->next;
+			free_rule(model, rule);
+			rule = next;
+		}
+		model->hashmap[b] = NULL;
+	}
+	lz->resident -= lz->bytes[c];
+	lz->bytes[c] = 0;
+	lz->lastuse[c] = 0;
+}
+
+void
+lazy_fault(ksh_model_t *model, uint32_t hash, int pin)
+{
+	struct ksh_lazy_t *lz = model->lazy;
+	uint32_t c = lz->bucketchunk[hash];
+	if (pin)
+		lz->pinned[c] = 1;
+	if (lz->lastuse[c]) {
+		lz->lastuse[c] = ++lz->clock;
+		return;
+	}
+	lazy_load(model, c);
+	while (lz->maxresident && lz->resident > lz->maxresident) {
+		// drop the least recently used chunk, never the one that was just loaded
+		uint64_t victim = lz->nchunks;
+		for (uint64_t i = 0; i < lz->nchunks; i++) {
+			if (i == c || !lz->lastuse[i] || lz->pinned[i])
+				continue;
+			if (victim == lz->nchunks || lz->lastuse[i] < lz->lastuse[victim])
+				victim = i;
+		}
+		if (victim == lz->nchunks)
+			break;
+		lazy_evict(model, victim);
+	}
+}
+
+int
+lazy_materialize(ksh_model_t *model)
+{
+	// loads everything that's still on disk, the model stops being lazy
+	struct ksh_lazy_t *lz = model->lazy;
+	int ret = 0;
+	for (uint64_t c = 0; c < lz->nchunks; c++) {
+		if (!lz->lastuse[c] && lazy_load(model, c) < 0)
+			ret = -1;
+	}
+	lazy_close(model);
+	return ret;
+}
+
+ksh_model_t*
+ksh_openmodel(const char *path, uint64_t maxresident, int64_t (*rng)(void*, int64_t), uint32_t seed)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return NULL;
+	ksh_model_t *model = NULL;
+	struct ksh_lazy_t *lz = NULL;
+	char header[5];
+	uint64_t mapsize, nchunks;
+	if (fread(header, sizeof(char), 5, f) != 5 || memcmp(header, "l\x05\x01\x04", 4))
+		goto openmodel_fail;
+	if (header[4] != 3) {
+		// not chunked, so it can only be loaded the usual way
+		rewind(f);
+		model = ksh_createmodel(16, rng, seed);
+		if (model && ksh_loadmodel(model, f) < 0)
+			goto openmodel_fail;
+		fclose(f);
+		return model;
+	}
+	if (lazy_readleb(f, &mapsize) < 0 || lazy_readleb(f, &nchunks) < 0)
+		goto openmodel_fail;
+	if (mapsize > 30 || nchunks == 0 || nchunks > ((uint64_t)1<<mapsize))
+		goto openmodel_fail;
+	model = ksh_createmodel(mapsize, rng, seed);
+	lz = calloc(1, sizeof(struct ksh_lazy_t));
+	if (!model || !lz)
+		goto openmodel_fail;
+	lz->nchunks = nchunks;
+	lz->maxresident = maxresident;
+	lz->firsts = calloc(sizeof(uint64_t), nchunks+1);
+	lz->offsets = calloc(sizeof(uint64_t), nchunks);
+	lz->lengths = calloc(sizeof(uint64_t), nchunks);
+	lz->lastuse = calloc(sizeof(uint64_t), nchunks);
+	lz->bytes = calloc(sizeof(uint64_t), nchunks);
+	lz->pinned = calloc(sizeof(char), nchunks);
+	lz->bucketchunk = calloc(sizeof(uint32_t), 1<<mapsize);
+	if (!lz->firsts || !lz->offsets || !lz->lengths || !lz->lastuse || !lz->bytes || !lz->pinned || !lz->bucketchunk)
+		goto openmodel_fail;
+	for (uint64_t c = 0; c < nchunks; c++) {
+		if (lazy_readleb(f, &lz->firsts[c]) < 0 || lazy_readleb(f, &lz->lengths[c]) < 0)
+			goto openmodel_fail;
+		if ((c > 0 && lz->firsts[c] < lz->firsts[c-1]) || lz->firsts[c] >= ((uint64_t)1<<mapsize))
+			goto openmodel_fail;
+	}
+	lz->firsts[0] = 0;
+	lz->firsts[nchunks] = 1<<mapsize;
+	for (uint64_t c = 0; c < nchunks; c++) {
+		for (uint64_t b = lz->firsts[c]; b < lz->firsts[c+1]; b++)
+			lz->bucketchunk[b] = c;
+	}
+	uint64_t offset = ftell(f);
+	for (uint64_t c = 0; c < nchunks; c++) {
+		lz->offsets[c] = offset;
+		offset += lz->lengths[c];
+	}
+	lz->fd = dup(fileno(f));
+	if (lz->fd < 0)
+		goto openmodel_fail;
+	fclose(f);
+	model->lazy = lz;
+	return model;
+
+	openmodel_fail:
+	if (lz) {
+		free(lz->firsts);
+		free(lz->offsets);
+		free(lz->lengths);
+		free(lz->lastuse);
+		free(lz->bytes);
+		free(lz->pinned);
+		free(lz->bucketchunk);
+		free(lz);
+	}
+	if (model)
+		ksh_freemodel(model);
+	fclose(f);
+	return NULL;
+}
+
+/*
+ * out-of-core training. the strings are buffered up to what the memory budget
+ * allows, then bulk sorted and counted like in ksh_bulkbuild and spilled to a
+ * temporary file as a run of RULEs, in the same encoding as the file format
+ * (rules sorted by name, continuations by character). at the end the runs are
+ * merged into the model file, the same way a merge sort would
+ */
+#define EXTRAIN_MAXRUNS 64 // more than that get merged into one, to keep the open files down
+// bytes needed for every byte of buffered text: itself, a pointer (at worst)
+// and two struct ngrams while it's being sorted
+#define EXTRAIN_BYTE_COST (1 + sizeof(char*) + 2*sizeof(struct ngram))
+
+struct ksh_extrain_t {
+	char *tmpdir;
+	char *text; // the strings since the last spill, each ending with its 0
+	size_t textlen, textcap;
+	size_t nstrings;
+	FILE *runs[EXTRAIN_MAXRUNS];
+	int nruns;
+	int error;
+};
+
+struct extrun {
+	FILE *f;
+	ksh_u32char name[4];
+	ksh_u32char ch;
+	uint32_t count;
+	int inrule;
+};
+
+int
+run_readchar(FILE *f, ksh_u32char *ch)
+{
+	char buf[4] = {0};
+	int c = fgetc(f);
+	if (c == EOF)
+		return -1;
+	buf[0] = c;
+	int len = !(c & 0x80) ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : -1;
+	if (len < 0 || (len > 1 && fread(&buf[1], 1, len-1, f) != len-1))
+		return -1;
+	return utf8_readcharacter(ch, buf) < 0 ? -1 : 0;
+}
+
+int
+run_next(struct extrun *r)
+{
+	// reads the next continuation of a run, returns 0 at its EOF MARKER
+	while (1) {
+		if (!r->inrule) {
+			int c = fgetc(r->f);
+			if (c == 0xFF)
+				return 0;
+			if (c == EOF)
+				return -1;
+			ungetc(c, r->f);
+			for (int i = 0; i < 4; i++) {
+				if (run_readchar(r->f, &r->name[i]) < 0)
+					return -1;
+			}
+			r->inrule = 1;
+		}
+		uint64_t prop;
+		if (run_readchar(r->f, &r->ch) < 0 || lazy_readleb(r->f, &prop) < 0)
+			return -1;
+		if (prop == 0) { // RULE END MARKER
+			r->inrule = 0;
+			continue;
+		}
+		r->count = prop > UINT32_MAX ? UINT32_MAX : prop;
+		return 1;
+	}
+}
+
+int
+run_less(struct extrun *a, struct extrun *b)
+{
+	for (int i = 0; i < 4; i++) {
+		if (a->name[i] != b->name[i])
+			return a->name[i] < b->name[i];
+	}
+	return a->ch < b->ch;
+}
+
+void
+run_siftdown(struct extrun **heap, int n, int i)
+{
+	while (1) {
+		int min = i;
+		int l = 2*i + 1, r = 2*i + 2;
+		if (l < n && run_less(heap[l], heap[min]))
+			min = l;
+		if (r < n && run_less(heap[r], heap[min]))
+			min = r;
+		if (min == i)
+			return;
+		struct extrun *swap = heap[i];
+		heap[i] = heap[min];
+		heap[min] = swap;
+		i = min;
+	}
+}
+
+int
+merge_runs(FILE **files, int n, FILE *out)
+{
+	// merges the runs into out, adding up the counts of the same continuations,
+	// and closes them. writes the RULEs and the EOF MARKER
+	struct extrun runs[EXTRAIN_MAXRUNS];
+	struct extrun *heap[EXTRAIN_MAXRUNS];
+	int nheap = 0;
+	int status = 0;
+	for (int i = 0; i < n; i++) {
+		memset(&runs[i], 0, sizeof(struct extrun));
+		runs[i].f = files[i];
+		rewind(files[i]);
+		int r = run_next(&runs[i]);
+		if (r < 0)
+			status = -1;
+		if (r > 0)
+			heap[nheap++] = &runs[i];
+	}
+	for (int i = nheap/2 - 1; i >= 0; i--)
+		run_siftdown(heap, nheap, i);
+	int inrule = 0;
+	ksh_u32char lastname[4];
+	while (nheap > 0 && status == 0) {
+		struct extrun *top = heap[0];
+		struct extrun cur = *top;
+		// pull in the same continuation from every run that has it
+		while (1) {
+			int r = run_next(top);
+			if (r < 0)
+				status = -1;
+			if (r <= 0)
+				heap[0] = heap[--nheap];
+			run_siftdown(heap, nheap, 0);
+			if (nheap == 0 || status < 0)
+				break;
+			top = heap[0];
+			if (run_less(&cur, top))
+				break;
+			uint32_t add = top->count;
+			if (cur.count > UINT32_MAX - add)
+				add = UINT32_MAX - cur.count;
+			cur.count += add;
+		}
+		if (inrule && 0 != memcmp(lastname, cur.name, 4*sizeof(ksh_u32char))) {
+			fwrite("\x00\x00", sizeof(char), 2, out); // RULE END MARKER
+			inrule = 0;
+		}
+		if (!inrule) {
+			save_name(cur.name, out);
+			memcpy(lastname, cur.name, 4*sizeof(ksh_u32char));
+			inrule = 1;
+		}
+		save_cont(cur.ch, cur.count, out);
+	}
+	if (inrule)
+		fwrite("\x00\x00", sizeof(char), 2, out); // RULE END MARKER
+	fwrite("\xFF", sizeof(char), 1, out); // EOF MARKER
+	for (int i = 0; i < n; i++)
+		fclose(files[i]);
+	return status < 0 || ferror(out) ? -1 : 0;
+}
+
+FILE*
+extrain_tmpfile(ksh_extrain_t *job)
+{
+	// the file is unlinked right away, so it goes away on its own when closed
+	size_t len = strlen(job->tmpdir) + sizeof("/koishi-XXXXXX");
+	char *path = malloc(len);
+	if (!path)
+		return NULL;
+	snprintf(path, len, "%s/koishi-XXXXXX", job->tmpdir);
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		free(path);
+		return NULL;
+	}
+	unlink(path);
+	free(path);
+	FILE *f = fdopen(fd, "w+");
+	if (!f)
+		close(fd);
+	return f;
+}
+
+int
+extrain_spill(ksh_extrain_t *job)
+{
+	// sorts and counts the buffered strings into a new run
+	if (job->nruns == EXTRAIN_MAXRUNS) {
+		FILE *merged = extrain_tmpfile(job);
+		if (!merged || merge_runs(job->runs, job->nruns, merged) < 0) {
+			if (merged)
+				fclose(merged);
+			job->nruns = 0;
+			return -1;
+		}
+		job->runs[0] = merged;
+		job->nruns = 1;
+	}
+	const char **strings = malloc((job->nstrings ? job->nstrings : 1) * sizeof(char*));
+	struct alphabet *al = calloc(1, sizeof(struct alphabet));
+	struct ngram *a = NULL;
+	FILE *run = NULL;
+	int status = -1;
+	if (!strings || !al)
+		goto spill_end;
+	for (size_t i = 0, off = 0; i < job->nstrings; i++) {
+		strings[i] = &job->text[off];
+		off += strlen(strings[i]) + 1;
+	}
+	size_t len;
+	a = ngram_collect(al, strings, job->nstrings, &len);
+	if (!a || !(run = extrain_tmpfile(job)))
+		goto spill_end;
+	ngram_save(al, a, len, run);
+	fwrite("\xFF", sizeof(char), 1, run); // EOF MARKER
+	if (fflush(run) != 0) {
+		fclose(run);
+		goto spill_end;
+	}
+	job->runs[job->nruns++] = run;
+	job->textlen = 0;
+	job->nstrings = 0;
+	status = 0;
+	spill_end:
+	free(a);
+	if (al)
+		free(al->chars);
+	free(al);
+	free(strings);
+	return status;
+}
+
+ksh_extrain_t*
+ksh_extrain_begin(const char *tmpdir, uint64_t membudget)
+{
+	ksh_extrain_t *job = calloc(1, sizeof(ksh_extrain_t));
+	if (!job)
+		return NULL;
+	job->tmpdir = strdup(tmpdir ? tmpdir : "/tmp");
+	uint64_t textcap = 0;
+	if (membudget > sizeof(struct alphabet))
+		textcap = (membudget - sizeof(struct alphabet)) / EXTRAIN_BYTE_COST;
+	job->textcap = textcap < 4096 ? 4096 : textcap;
+	job->text = malloc(job->textcap);
+	if (!job->tmpdir || !job->text) {
+		free(job->tmpdir);
+		free(job->text);
+		free(job);
+		return NULL;
+	}
+	return job;
+}
+
+int
+ksh_extrain_add(ksh_extrain_t *job, const char *str)
+{
+	if (job->error)
+		return -1;
+	size_t len = strlen(str) + 1;
+	if (job->textlen + len > job->textcap && job->textlen > 0) {
+		if (extrain_spill(job) < 0) {
+			job->error = 1;
+			return -1;
+		}
+	}
+	if (len > job->textcap) { // doesn't fit even on its own, so it has to go over budget
+		char *text = realloc(job->text, len);
+		if (!text) {
+			job->error = 1;
+			return -1;
+		}
+		job->text = text;
+		job->textcap = len;
+	}
+	memcpy(&job->text[job->textlen], str, len);
+	job->textlen += len;
+	job->nstrings++;
+	return 0;
+}
+
+int
+ksh_extrain_finish(ksh_extrain_t *job, FILE *f)
+{
+	int status = job->error ? -1 : 0;
+	if (status == 0 && job->nstrings > 0)
+		status = extrain_spill(job);
+	if (status == 0) {
+		fwrite("l\x05\x01\x04\x02", sizeof(char), 5, f); // HEADER + VERSION
+		status = merge_runs(job->runs, job->nruns, f);
+	} else {
+		for (int i = 0; i < job->nruns; i++)
+			fclose(job->runs[i]);
+	}
+	free(job->text);
+	free(job->tmpdir);
+	free(job);
+	return status;
+}
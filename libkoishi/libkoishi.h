@@ -2,6 +2,11 @@
 #define _LIBKOISHI_H
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #define KSH_CONTINUATIONS_PER_HEADER 1
 #define KSH_CONTINUATIONS_PER_STRUCT 4
@@ -25,6 +30,7 @@ struct ksh_rule_t {
 	int64_t probtotal;
 	ksh_u32char character[KSH_CONTINUATIONS_PER_HEADER];
 	uint32_t probability[KSH_CONTINUATIONS_PER_HEADER];
+	uint32_t stamp; // epoch the counts were last decayed in, and a reference bit, see ksh_setbounded
 	// a few continuations are going already into the rule object, to avoid
 	// the memory overhead of allocating an entire ksh_continuation_t
 	// in v1 around 60% of rules had only one cont, 80% had only two
@@ -32,26 +38,283 @@ struct ksh_rule_t {
 };
 typedef struct ksh_rule_t ksh_rule_t;
 
+// frozen models:
+// a read-only copy of the model, laid out as flat arrays in one allocation.
+// every continuation also stores the index of the rule it leads to
+// (the one named name[1..3]+character), so generation can just walk
+// the graph instead of hashing the name window on every step
+#define KSH_NOLINK 0xFFFFFFFF
+
+struct ksh_frozenrule_t {
+	ksh_u32char name[4];
+	int64_t probtotal;
+	uint32_t first; // index of the first continuation
+	uint32_t count; // number of continuations
+};
+typedef struct ksh_frozenrule_t ksh_frozenrule_t;
+
+struct ksh_frozen_t {
+	char magic[4]; // l\x05\x01\x04, same as the file format
+	uint32_t version;
+	uint32_t mapsize;
+	uint32_t nrules;
+	uint32_t nconts;
+	uint64_t size; // size of the entire allocation, including this header
+	// offsets from the start of the header, so the block doesn't care where it lives
+	uint64_t bucketoff; // uint32_t[2^mapsize + 1], index of the first rule in each bucket
+	uint64_t ruleoff; // ksh_frozenrule_t[nrules]
+	uint64_t charoff; // ksh_u32char[nconts]
+	uint64_t proboff; // uint32_t[nconts]
+	uint64_t linkoff; // uint32_t[nconts], index of the next rule or KSH_NOLINK
+};
+typedef struct ksh_frozen_t ksh_frozen_t;
+
+// see ksh_createstring_ex
+struct ksh_reach_t {
+	uint64_t lengths; // bit i is set if the string can end after exactly i more characters
+	uint16_t fewest, most; // bounds on the number of characters left, most is 0xFFFF if unbounded
+};
+typedef struct ksh_reach_t ksh_reach_t;
+
+// rules and continuations are carved out of big slabs instead of being
+// allocated one by one, freed objects go on a freelist for reuse
+struct ksh_pool_t {
+	void *slabs; // linked through the first pointer of every slab
+	char *cur, *end; // unused part of the newest slab
+	void *freelist;
+	size_t objsize;
+	size_t slabobjs; // size of the next slab, doubles every time
+	size_t live; // objects allocated and not freed
+	int allocflags, allocnode; // where new slabs go, see ksh_setalloc
+};
+typedef struct ksh_pool_t ksh_pool_t;
+
 struct ksh_model_t {
     int mapsize; // hashmap[2^mapsize], preferably between 8 and 20
-	ksh_rule_t **hashmap;
+	ksh_rule_t **hashmap; // NULL while the model is frozen
+	uint64_t nrules;
+	ksh_pool_t rulepool;
+	ksh_pool_t contpool;
     int64_t (*rng)(void*, int64_t);
     void *rngdata;
+	ksh_frozen_t *frozen; // NULL unless the model is frozen
+	int mapped; // frozen points into a mapping from ksh_mapmodel and can't be freed
+	struct ksh_reach_t *reach; // for every frozen rule, how long the string can still get
+	struct ksh_lazy_t *lazy; // NULL unless opened with ksh_openmodel
+	int genflags; // KSH_GEN_*
+	// bloom filter of trained strings, see ksh_trackrecords
+	uint64_t *seen;
+	uint64_t seenbits; // power of two
+	int seenhashes;
+	// bounded mode, see ksh_setbounded
+	int bounded;
+	uint64_t maxbytes;
+	uint64_t halflife;
+	uint64_t sincedecay; // strings trained in this epoch
+	uint32_t epoch;
+	uint64_t clockhand; // the next bucket eviction looks at
+	struct ksh_model_t *base; // frozen model this one is an overlay on, see ksh_overlaymodel
+	int overlays; // how many overlays are on this one, it can't be thawed until they're gone
+	int allocflags, allocnode; // KSH_ALLOC_*, see ksh_setalloc
 };
 typedef struct ksh_model_t ksh_model_t;
 
+// rng(rngdata, max) has to return a number in [0, max),
+// NULL means the built-in one, seeded with the pcg engine
 ksh_model_t *ksh_createmodel(int mapsize, int64_t (*rng)(void*, int64_t), uint32_t seed);
-void ksh_freemodel(ksh_model_t *model);
+// switches the model to the built-in rng, using one of the engines from rnd.h
+#define KSH_RNG_PCG 0
+#define KSH_RNG_XORSHIFT 1
+#define KSH_RNG_WELL 2
+#define KSH_RNG_PHILOX 3 // counter-based, see ksh_createstring_at
+int ksh_setrng(ksh_model_t *model, int engine, uint64_t seed);
+// returns -1 and frees nothing while the model has overlays on it
+int ksh_freemodel(ksh_model_t *model);
+
+// a copy of the model that can be trained and generated from on its own,
+// including the state of the built-in rng (a custom rng's rngdata is shared).
+// frozen models are copied in one go, others into slabs sized for them
+ksh_model_t *ksh_clonemodel(ksh_model_t *model);
+// an empty model on top of base, which only stores the counts it was trained
+// on itself, so it takes as little memory as what was added. generating and
+// scoring go by the base's counts plus its own, saving and loading only
+// handle its own. base gets frozen, and can't be freed while it has
+// overlays; anything that would thaw it fails until they're freed or
+// frozen. freezing an overlay adds the base's counts in and makes it a
+// standalone model, it can't be exported or turned into a trie or compact
+// model before that
+ksh_model_t *ksh_overlaymodel(ksh_model_t *base, int mapsize, int64_t (*rng)(void*, int64_t), uint32_t seed);
+
+// where the hashmap, slabs and frozen form of the model are allocated.
+// huge pages are only used for allocations of 2 MiB and up, with
+// KSH_ALLOC_HUGETLB falling back to transparent ones when the pool is empty.
+// numa placement is advice, on kernels without it nothing changes.
+// the hashmap and frozen form are moved right away, existing slabs stay put,
+// so for loading or training a big model this should be set first
+#define KSH_ALLOC_THP 1 // madvise for transparent huge pages
+#define KSH_ALLOC_HUGETLB 2 // explicit 2 MiB pages, MAP_HUGETLB
+#define KSH_ALLOC_INTERLEAVE 4 // pages spread over all the numa nodes
+#define KSH_ALLOC_NODE 8 // pages on the given node if it has room
+int ksh_setalloc(ksh_model_t *model, int flags, int node);
+int ksh_numa_nodes(void); // how many nodes there are to allocate on
+int ksh_numa_node(void); // the node the calling thread is running on
+// a frozen clone (model gets frozen if it isn't) placed on one numa node, with
+// the same huge page flags, so generating threads can each use the one on
+// their own node. it starts out with a copy of the rng state, so every
+// replica should get a seed of its own, or go through ksh_createstring_at
+ksh_model_t *ksh_replicamodel(ksh_model_t *model, int node);
+
+// sizes the hashmap and slabs for that many rules up front, so training
+// doesn't have to grow them or put up with long chains
+int ksh_reserve(ksh_model_t *model, uint64_t expected_rules);
+ksh_model_t *ksh_createmodel_sized(uint64_t expected_rules, int64_t (*rng)(void*, int64_t), uint32_t seed);
+// guesses how many rules training on totalsize bytes of text will create,
+// from a sample of it (newline-separated strings, like the corpus)
+uint64_t ksh_estimaterules(const char *sample, size_t samplelen, uint64_t totalsize);
 
 void ksh_makeassociation(ksh_model_t *model, ksh_u32char *name, ksh_u32char ch);
 ksh_u32char ksh_getcontinuation(ksh_model_t *model, ksh_u32char *name);
 
 void ksh_trainmarkov(ksh_model_t *model, const char *str);
+// same as training on str weight times over, counts saturate at UINT32_MAX
+void ksh_trainmarkov_weighted(ksh_model_t *model, const char *str, uint32_t weight);
+// for strings that aren't 0-terminated, they end after len bytes or at a 0, whichever comes first
+void ksh_trainmarkov_len(ksh_model_t *model, const char *str, size_t len, uint32_t weight);
+// trains on n strings (lens can be NULL if they're 0-terminated) with nthreads
+// threads, each one taking care of a part of the hashmap. the result is the
+// same as training on them one by one. the hashmap doesn't grow meanwhile,
+// so it should be sized with ksh_reserve first. bounded models are trained
+// on one thread. returns -1 if it ran out of memory, the model is then missing
+// some of the strings
+int ksh_trainmarkov_parallel(ksh_model_t *model, const char **strings, const size_t *lens, size_t n, int nthreads);
+// from now on, remember every trained string in a bloom filter taking up
+// bits_per_record bits for each of expected_records strings (10 bits is ~1% false positives).
+// with KSH_GEN_NOVEL in model->genflags, generating one of them again is retried.
+// the filter is capped at 2^36 bits (8 GiB), returns -1 if bits_per_record < 1
+int ksh_trackrecords(ksh_model_t *model, uint64_t expected_records, int bits_per_record);
+// for training on an endless stream. every halflife trained strings all the
+// counts get halved (each rule catches up the next time it's used, so there's
+// no sweep over the whole model) and continuations that reach 0 are dropped.
+// if the rules, continuations and hashmap take more than maxbytes, rules that
+// weren't used since the last time eviction came around are thrown out.
+// either can be 0 to turn it off
+int ksh_setbounded(ksh_model_t *model, uint64_t maxbytes, uint64_t halflife);
+#define KSH_GEN_NOVEL 1
+#define KSH_NOVEL_TRIES 16 // after that many, it gives up and returns a copy anyway
 void ksh_createstring(ksh_model_t *model, char *buf, size_t bufsize);
+// generates a string starting with prefix (can be NULL), between minlen and
+// maxlen codepoints long (maxlen <= 0 means no limit) without retrying, by
+// only picking continuations that can still end within the limits.
+// returns the length in codepoints, or -1 if the limits can't be met.
+// that is exact for limits up to 64 codepoints; past that only the fewest
+// and most characters still reachable are known, so it's best-effort and
+// can give up with -1 partway through a string. works on the frozen form,
+// so the model gets frozen if it isn't yet
+int ksh_createstring_ex(ksh_model_t *model, char *buf, size_t bufsize, const char *prefix, int minlen, int maxlen);
+// generates string number index of the stream, the same one every time no
+// matter what was generated before or on which thread, so work can be split
+// up in any way and still give the same strings. needs the KSH_RNG_PHILOX rng
+// (returns -1 otherwise), whose seed picks the set of streams. works on the
+// frozen form: once the model is frozen, any number of threads can call this
+// at the same time, as long as nothing changes the model
+int ksh_createstring_at(ksh_model_t *model, uint32_t stream, uint64_t index, char *buf, size_t bufsize);
+// generating one character at a time, for showing a string while it's being
+// made: ksh_gen_next returns the next codepoint, 0 once the string has ended.
+// the utf-8 variant writes it to out (which needs room for 4 bytes, nothing
+// gets 0-terminated) and returns the number of bytes, 0 at the end.
+// KSH_GEN_NOVEL can't be applied, the string is out before it's complete
+typedef struct ksh_gen_t ksh_gen_t;
+ksh_gen_t *ksh_gen_begin(ksh_model_t *model);
+ksh_u32char ksh_gen_next(ksh_gen_t *gen);
+int ksh_gen_next_utf8(ksh_gen_t *gen, char *out);
+void ksh_gen_free(ksh_gen_t *gen);
+// natural log of the probability of the model generating each of the strings,
+// -INFINITY if it can't generate it at all
+void ksh_scorestrings(ksh_model_t *model, const char **strings, size_t n, double *out_logprob);
+// same, with the length of each string in lens
+void ksh_scorestrings_len(ksh_model_t *model, const char **strings, const size_t *lens, size_t n, double *out_logprob);
+
+// trains on all of the strings at once, by sorting and counting the transitions
+// first and then creating every rule in one go, much faster than
+// ksh_trainmarkov one string at a time for a full rebuild. continuations
+// of new rules end up ordered by character instead of by first appearance
+int ksh_bulkbuild(ksh_model_t *model, const char **strings, size_t n);
+// same, but writes the model file directly without building a model
+int ksh_bulksave(const char **strings, size_t n, FILE *f);
+// training on more text than fits in memory: strings are buffered, counted
+// and spilled to temporary files in tmpdir (NULL for /tmp) whenever
+// membudget bytes would be exceeded, finishing merges them into a model file
+typedef struct ksh_extrain_t ksh_extrain_t;
+ksh_extrain_t *ksh_extrain_begin(const char *tmpdir, uint64_t membudget);
+int ksh_extrain_add(ksh_extrain_t *job, const char *str);
+int ksh_extrain_finish(ksh_extrain_t *job, FILE *f); // frees the job, even if it fails
+
+// freezing throws away the hashmap and keeps only the frozen copy,
+// training a frozen model thaws it back automatically. a model with
+// overlays on it can't be thawed, that returns -1
+int ksh_freezemodel(ksh_model_t *model);
+int ksh_thawmodel(ksh_model_t *model);
+// the frozen form has no pointers in it, so it can be written to a file,
+// a memfd or shm_open object and mapped read-only by any number of processes
+#define KSH_FROZEN_VERSION 1
+int ksh_exportmodel(ksh_model_t *model, int fd);
+ksh_model_t *ksh_mapmodel(int fd, int64_t (*rng)(void*, int64_t), uint32_t seed);
+
+// another read-only copy of the model, as a trie on the names: rules sharing
+// the start of their names share the memory for it too. lookups take a few
+// searches instead of a hash, generating only one. the model is only used for
+// its rng, and has to be kept around for that. a frozen model stays frozen
+typedef struct ksh_trie_t ksh_trie_t;
+ksh_trie_t *ksh_buildtrie(ksh_model_t *model);
+void ksh_freetrie(ksh_trie_t *trie);
+size_t ksh_triesize(ksh_trie_t *trie); // in bytes
+ksh_u32char ksh_trie_getcontinuation(ksh_model_t *model, ksh_trie_t *trie, ksh_u32char *name);
+void ksh_trie_createstring(ksh_model_t *model, ksh_trie_t *trie, char *buf, size_t bufsize);
+
+// a lossy read-only copy for small machines: every rule's distribution gets
+// rounded to 2^bits steps (1 to 16, 8 or 4 make sense), names and continuations
+// are bit-packed. kl gets how far the result is from the model (the kl
+// divergence in nats per character, over the continuations that were kept),
+// dropped the probability of the ones that didn't fit into 2^bits steps.
+// like the trie, the model is needed for its rng
+typedef struct ksh_compact_t ksh_compact_t;
+ksh_compact_t *ksh_compactmodel(ksh_model_t *model, int bits, double *kl, double *dropped);
+void ksh_freecompact(ksh_compact_t *c);
+size_t ksh_compactsize(ksh_compact_t *c); // in bytes
+ksh_u32char ksh_compact_getcontinuation(ksh_model_t *model, ksh_compact_t *c, ksh_u32char *name);
+void ksh_compact_createstring(ksh_model_t *model, ksh_compact_t *c, char *buf, size_t bufsize);
+int ksh_savecompact(ksh_compact_t *c, FILE *f);
+ksh_compact_t *ksh_loadcompact(FILE *f);
 
 void ksh_savemodel(ksh_model_t *model, FILE *f);
+// saves a snapshot of the model on a background thread, the model can be
+// trained (or freed) while it runs. done, if not NULL, gets called from that
+// thread when it's finished. the job has to be collected with ksh_savejob_wait
+#define KSH_SAVE_RUNNING 1
+typedef struct ksh_savejob_t ksh_savejob_t;
+ksh_savejob_t *ksh_savemodel_async(ksh_model_t *model, FILE *f, void (*done)(int status, void *userdata), void *userdata);
+int ksh_savejob_status(ksh_savejob_t *job); // KSH_SAVE_RUNNING, 0 when saved, <0 on error
+int ksh_savejob_wait(ksh_savejob_t *job);
 int ksh_loadmodel(ksh_model_t *model, FILE *f);
+// the chunked format splits the rules into chunks by hash bucket, which
+// ksh_loadmodel_parallel can then decode on separate threads
+int ksh_savemodel_chunked(ksh_model_t *model, FILE *f, int nchunks);
+int ksh_loadmodel_parallel(ksh_model_t *model, FILE *f, int nthreads);
+// the packed format sorts the rules so that they can be stored as differences
+// from each other, which makes the files a lot smaller, even more so with
+// compress set. ksh_loadmodel reads it like the others
+int ksh_savemodel_packed(ksh_model_t *model, FILE *f, int compress);
+// opens a chunked model file without loading it, chunks get read in the first
+// time one of their rules is looked up. if maxresident isn't 0, chunks that
+// weren't used in a while are dropped again to keep the memory used by rules
+// under that many bytes (chunks that were trained on are kept).
+// saving, freezing or resizing the model loads the rest of it first
+ksh_model_t *ksh_openmodel(const char *path, uint64_t maxresident, int64_t (*rng)(void*, int64_t), uint32_t seed);
+
+int ksh_freemodel(ksh_model_t *);
 
-void ksh_freemodel(ksh_model_t *);
+#ifdef __cplusplus
+}
+#endif
 
 #endif
\ No newline at end of file
@@ -0,0 +1,68 @@
+// a background save has to write the model as it was when the save started,
+// no matter how much it gets trained on while the save is running
+#include "libkoishi.h"
+#include "corpus.h"
+
+#define NSTRINGS 40000
+#define NSAVES 8
+
+static void
+done(int status, void *userdata)
+{
+	*(int*)userdata = status;
+}
+
+int
+main(void)
+{
+	const char **strings = corpus(NSTRINGS, 1);
+	int failed = 0;
+	ksh_model_t *model = ksh_createmodel(10, NULL, 0), *ref = ksh_createmodel(10, NULL, 0);
+	size_t trained = 0;
+	for (int s = 0; s < NSAVES; s++) {
+		size_t upto = trained + NSTRINGS / NSAVES / 2;
+		for (; trained < upto; trained++) {
+			ksh_trainmarkov(model, strings[trained]);
+			ksh_trainmarkov(ref, strings[trained]);
+		}
+		if (s % 2)
+			ksh_freezemodel(model); // frozen models get copied for the snapshot
+		char *data = NULL;
+		size_t len = 0;
+		FILE *f = open_memstream(&data, &len);
+		int status = 1;
+		ksh_savejob_t *job = ksh_savemodel_async(model, f, done, &status);
+		if (!job) {
+			puts("asyncsave: the save didn't start");
+			return 1;
+		}
+		// trained on for as long as the save runs, and then some
+		for (upto = trained + NSTRINGS / NSAVES / 2; trained < upto; trained++)
+			ksh_trainmarkov(model, strings[trained]);
+		if (ksh_savejob_wait(job) != 0 || status != 0) {
+			printf("asyncsave: save %d failed\n", s);
+			failed = 1;
+		}
+		fclose(f);
+		ksh_model_t *back = loaded(data, len, 10, 1);
+		if (!back || !same_counts(back, ref)) {
+			printf("asyncsave: save %d isn't the model from when it started\n", s);
+			failed = 1;
+		}
+		if (back)
+			ksh_freemodel(back);
+		free(data);
+		for (size_t i = upto - NSTRINGS / NSAVES / 2; i < upto; i++)
+			ksh_trainmarkov(ref, strings[i]);
+	}
+	if (!same_counts(model, ref)) {
+		puts("asyncsave: training while saving lost some of it");
+		failed = 1;
+	}
+
+	ksh_freemodel(model);
+	ksh_freemodel(ref);
+	free(strings);
+	puts(failed ? "asyncsave: FAILED" : "asyncsave: ok");
+	return failed;
+}
@@ -0,0 +1,63 @@
+// a bounded model has to stay under maxbytes after every trained string, and
+// keep its rule count right while rules get evicted and decay away.
+// bounded_bytes is internal, so the library gets built right into the test
+#include "../libkoishi/libkoishi.c"
+#include "corpus.h"
+
+#define NSTRINGS 40000
+
+static uint64_t
+countrules(ksh_model_t *model)
+{
+	uint64_t n = 0;
+	for (uint64_t b = 0; b < ((uint64_t)1 << model->mapsize); b++) {
+		for (ksh_rule_t *rule = model->hashmap[b]; rule != NULL; rule = rule->next)
+			n++;
+	}
+	return n;
+}
+
+int
+main(void)
+{
+	const char **strings = corpus(NSTRINGS, 7);
+	int failed = 0;
+	static const uint64_t limits[][2] = {{1<<16, 0}, {1<<18, 0}, {1<<16, 500}, {0, 500}};
+	for (int l = 0; l < sizeof(limits)/sizeof(limits[0]); l++) {
+		uint64_t maxbytes = limits[l][0], halflife = limits[l][1];
+		ksh_model_t *model = ksh_createmodel(10, NULL, 0);
+		ksh_setbounded(model, maxbytes, halflife);
+		uint64_t most = 0;
+		for (size_t i = 0; i < NSTRINGS; i++) {
+			ksh_trainmarkov(model, strings[i]);
+			if (bounded_bytes(model) > most)
+				most = bounded_bytes(model);
+		}
+		if (maxbytes && most > maxbytes) {
+			printf("bounded: a model limited to %lu bytes took %lu\n", (unsigned long)maxbytes, (unsigned long)most);
+			failed = 1;
+		}
+		if (model->nrules == 0 || model->nrules != countrules(model) || model->nrules != model->rulepool.live) {
+			printf("bounded: the model thinks it has %lu rules, but there's %lu\n",
+				(unsigned long)model->nrules, (unsigned long)countrules(model));
+			failed = 1;
+		}
+		ksh_freemodel(model);
+	}
+
+	// bounding a model that's already too big evicts right away
+	ksh_model_t *model = ksh_createmodel(10, NULL, 0);
+	for (size_t i = 0; i < NSTRINGS; i++)
+		ksh_trainmarkov(model, strings[i]);
+	uint64_t before = bounded_bytes(model);
+	ksh_setbounded(model, before / 4, 0);
+	if (bounded_bytes(model) > before / 4 || model->nrules != countrules(model)) {
+		puts("bounded: ksh_setbounded didn't bring the model under its new limit");
+		failed = 1;
+	}
+	ksh_freemodel(model);
+
+	free(strings);
+	puts(failed ? "bounded: FAILED" : "bounded: ok");
+	return failed;
+}
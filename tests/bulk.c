@@ -0,0 +1,52 @@
+// building a model in bulk, or writing it straight to a file, has to count
+// the same as training on the strings one by one
+#include "libkoishi.h"
+#include "corpus.h"
+
+#define NSTRINGS 20000
+
+int
+main(void)
+{
+	const char **strings = corpus(NSTRINGS, 5);
+	ksh_model_t *ref = ksh_createmodel(10, NULL, 0);
+	for (size_t i = 0; i < NSTRINGS; i++)
+		ksh_trainmarkov(ref, strings[i]);
+
+	int failed = 0;
+	ksh_model_t *model = ksh_createmodel(10, NULL, 0);
+	if (ksh_bulkbuild(model, strings, NSTRINGS) < 0 || !same_counts(model, ref)) {
+		puts("bulk: ksh_bulkbuild is different from ksh_trainmarkov");
+		failed = 1;
+	}
+	ksh_freemodel(model);
+
+	// on top of rules that are already there
+	model = ksh_createmodel(8, NULL, 0);
+	for (size_t i = 0; i < NSTRINGS / 3; i++)
+		ksh_trainmarkov(model, strings[i]);
+	if (ksh_bulkbuild(model, strings + NSTRINGS / 3, NSTRINGS - NSTRINGS / 3) < 0 || !same_counts(model, ref)) {
+		puts("bulk: ksh_bulkbuild on a trained model is different from ksh_trainmarkov");
+		failed = 1;
+	}
+	ksh_freemodel(model);
+
+	char *data = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&data, &len);
+	int ret = ksh_bulksave(strings, NSTRINGS, f);
+	fclose(f);
+	model = ret < 0 ? NULL : loaded(data, len, 10, 1);
+	if (!model || !same_counts(model, ref)) {
+		puts("bulk: the file from ksh_bulksave is different from ksh_trainmarkov");
+		failed = 1;
+	}
+	if (model)
+		ksh_freemodel(model);
+	free(data);
+
+	ksh_freemodel(ref);
+	free(strings);
+	puts(failed ? "bulk: FAILED" : "bulk: ok");
+	return failed;
+}
@@ -0,0 +1,76 @@
+// a chunked file has to load back to the same model, on any number of threads
+// and into any mapsize, and a truncated one mustn't load at all
+#include "libkoishi.h"
+#include "corpus.h"
+
+#define NSTRINGS 20000
+
+int
+main(void)
+{
+	const char **strings = corpus(NSTRINGS, 2);
+	ksh_model_t *model = ksh_createmodel(10, NULL, 0);
+	for (size_t i = 0; i < NSTRINGS; i++)
+		ksh_trainmarkov(model, strings[i]);
+
+	int failed = 0;
+	static const int nchunks[] = {1, 7, 64, 1024};
+	for (int c = 0; c < sizeof(nchunks)/sizeof(nchunks[0]); c++) {
+		char *data = NULL;
+		size_t len = 0;
+		FILE *f = open_memstream(&data, &len);
+		if (ksh_savemodel_chunked(model, f, nchunks[c]) < 0) {
+			printf("chunked: saving in %d chunks failed\n", nchunks[c]);
+			return 1;
+		}
+		fclose(f);
+		char *serial = NULL;
+		size_t seriallen = 0;
+		for (int nthreads = 1; nthreads <= 4; nthreads *= 2) {
+			// with the same mapsize, any number of threads puts every rule
+			// in the same place as one thread does
+			ksh_model_t *back = loaded(data, len, 10, nthreads);
+			size_t backlen = 0;
+			char *backdata = back ? saved(back, &backlen) : NULL;
+			if (!back || !same_counts(back, model)
+					|| (serial && (backlen != seriallen || memcmp(backdata, serial, backlen)))) {
+				printf("chunked: %d chunks on %d threads came back different\n", nchunks[c], nthreads);
+				failed = 1;
+			}
+			if (nthreads == 1) {
+				serial = backdata;
+				seriallen = backlen;
+			} else {
+				free(backdata);
+			}
+			if (back)
+				ksh_freemodel(back);
+			static const int mapsizes[] = {6, 13};
+			for (int m = 0; m < 2; m++) {
+				back = loaded(data, len, mapsizes[m], nthreads);
+				if (!back || !same_counts(back, model)) {
+					printf("chunked: %d chunks on %d threads into mapsize %d came back different\n",
+						nchunks[c], nthreads, mapsizes[m]);
+					failed = 1;
+				}
+				if (back)
+					ksh_freemodel(back);
+			}
+		}
+		for (size_t cut = 0; cut < len; cut += cut < 64 ? 1 : 331) {
+			ksh_model_t *back = loaded(data, cut, 10, 4);
+			if (back) {
+				printf("chunked: %d chunks cut to %zu of %zu bytes loaded\n", nchunks[c], cut, len);
+				failed = 1;
+				ksh_freemodel(back);
+			}
+		}
+		free(serial);
+		free(data);
+	}
+
+	ksh_freemodel(model);
+	free(strings);
+	puts(failed ? "chunked: FAILED" : "chunked: ok");
+	return failed;
+}
@@ -0,0 +1,126 @@
+// a compact model has to survive a save and load unchanged, and a truncated
+// or corrupted file has to be refused, or at least be safe to generate from
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libkoishi.h"
+
+#define NSTRINGS 3000
+#define NCORRUPT 2000
+
+static const char *syllables[] = {
+	"ko", "i", "shi", "me", "ji", "sa", "to", "ri", "o", "ku", "u", "ne",
+	"ą", "ж", "ę", "の", "こ",
+};
+
+static char *
+saved(ksh_compact_t *c, size_t *len)
+{
+	char *data = NULL;
+	FILE *f = open_memstream(&data, len);
+	ksh_savecompact(c, f);
+	fclose(f);
+	return data;
+}
+
+static ksh_compact_t *
+loaded(char *data, size_t len)
+{
+	FILE *f = fmemopen(data, len, "r");
+	ksh_compact_t *c = ksh_loadcompact(f);
+	fclose(f);
+	return c;
+}
+
+int
+main(void)
+{
+	ksh_model_t *model = ksh_createmodel(10, NULL, 0);
+	uint32_t x = 1;
+	for (int i = 0; i < NSTRINGS; i++) {
+		char s[64];
+		size_t len = 0;
+		while (1) {
+			x = x * 1103515245 + 12345;
+			const char *syl = syllables[(x >> 16) % (sizeof(syllables)/sizeof(syllables[0]))];
+			if (len + strlen(syl) >= sizeof(s) || ((x >> 8) & 7) == 0)
+				break;
+			memcpy(&s[len], syl, strlen(syl));
+			len += strlen(syl);
+		}
+		s[len] = 0;
+		ksh_trainmarkov(model, s);
+	}
+	ksh_setrng(model, KSH_RNG_PHILOX, 1);
+
+	int failed = 0;
+	ksh_compact_t *c = ksh_compactmodel(model, 8, NULL, NULL);
+	size_t len, againlen;
+	char *data = saved(c, &len);
+	ksh_compact_t *back = loaded(data, len);
+	if (!back) {
+		puts("compact: a saved model didn't load");
+		return 1;
+	}
+	char *again = saved(back, &againlen);
+	if (againlen != len || memcmp(data, again, len)) {
+		puts("compact: a loaded model is different from the saved one");
+		failed = 1;
+	}
+	free(again);
+	ksh_freecompact(back);
+
+	for (size_t cut = 0; cut < len; cut += cut < 256 ? 1 : 97) {
+		back = loaded(data, cut);
+		if (back) {
+			printf("compact: the model cut to %zu of %zu bytes loaded\n", cut, len);
+			failed = 1;
+			ksh_freecompact(back);
+		}
+	}
+
+	// a size that's too big for the file mustn't get allocated up front
+	char *copy = malloc(len);
+	memcpy(copy, data, len);
+	uint64_t size = (uint64_t)1 << 39;
+	memcpy(copy + 32, &size, sizeof(size)); // ksh_compact_t.size, after the 7 uint32s
+	back = loaded(copy, len);
+	if (back) {
+		puts("compact: a model with a made up size loaded");
+		failed = 1;
+		ksh_freecompact(back);
+	}
+
+	// anything that still loads after a few flipped bytes is generated from,
+	// the sanitizers catch it if that reads out of bounds
+	int refused = 0;
+	for (int i = 0; i < NCORRUPT; i++) {
+		memcpy(copy, data, len);
+		for (int j = 0; j < 1 + i % 4; j++) {
+			x = x * 1103515245 + 12345;
+			size_t at = (x >> 8) % len;
+			x = x * 1103515245 + 12345;
+			copy[at] ^= 1 << ((x >> 16) & 7);
+		}
+		back = loaded(copy, len);
+		if (!back) {
+			refused++;
+			continue;
+		}
+		char buf[64];
+		for (int j = 0; j < 16; j++)
+			ksh_compact_createstring(model, back, buf, sizeof(buf));
+		ksh_freecompact(back);
+	}
+	if (refused == 0) {
+		puts("compact: none of the corrupted models were refused");
+		failed = 1;
+	}
+
+	free(copy);
+	free(data);
+	ksh_freecompact(c);
+	ksh_freemodel(model);
+	puts(failed ? "compact: FAILED" : "compact: ok");
+	return failed;
+}
@@ -0,0 +1,88 @@
+// made up strings and ways of comparing models, shared by the tests
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *syllables[] = {
+	"ko", "i", "shi", "me", "ji", "sa", "to", "ri", "o", "ku", "u", "ne",
+	"ą", "ж", "ę", "ß", "ー", "の", "こ", "い", "し",
+};
+
+static inline const char **
+corpus(size_t n, uint32_t seed)
+{
+	// n 0-terminated strings of up to 31 bytes in one allocation, some of
+	// them ending in the start of a character that never comes
+	const char **strings = malloc(n * (sizeof(char*) + 32));
+	char *buf = (char*)&strings[n];
+	uint32_t x = seed;
+	for (size_t i = 0; i < n; i++) {
+		char *s = &buf[i * 32];
+		size_t len = 0;
+		while (1) {
+			x = x * 1103515245 + 12345;
+			const char *syl = syllables[(x >> 16) % (sizeof(syllables)/sizeof(syllables[0]))];
+			if (len + strlen(syl) >= 31 || ((x >> 8) & 7) == 0)
+				break;
+			memcpy(&s[len], syl, strlen(syl));
+			len += strlen(syl);
+		}
+		if ((x & 0xFF) == 0 && len < 31)
+			s[len++] = '\xC4';
+		s[len] = 0;
+		strings[i] = s;
+	}
+	return strings;
+}
+
+static inline char *
+saved(ksh_model_t *model, size_t *len)
+{
+	char *data = NULL;
+	FILE *f = open_memstream(&data, len);
+	ksh_savemodel(model, f);
+	fclose(f);
+	return data;
+}
+
+static inline char *
+canonical(ksh_model_t *model, size_t *len)
+{
+	// the packed format sorts the rules and continuations, so two models with
+	// the same counts give the same bytes, whatever their mapsize or history
+	char *data = NULL;
+	FILE *f = open_memstream(&data, len);
+	ksh_savemodel_packed(model, f, 0);
+	fclose(f);
+	return data;
+}
+
+static inline int
+same_counts(ksh_model_t *a, ksh_model_t *b)
+{
+	size_t alen, blen;
+	char *adata = canonical(a, &alen), *bdata = canonical(b, &blen);
+	int same = alen == blen && !memcmp(adata, bdata, alen);
+	free(adata);
+	free(bdata);
+	return same;
+}
+
+static inline ksh_model_t *
+loaded(const char *data, size_t len, int mapsize, int nthreads)
+{
+	// NULL if the data doesn't load
+	ksh_model_t *model = ksh_createmodel(mapsize, NULL, 0);
+	FILE *f = fmemopen((void*)data, len, "r");
+	if (!f) { // an empty buffer, on older libcs
+		ksh_freemodel(model);
+		return NULL;
+	}
+	int ret = ksh_loadmodel_parallel(model, f, nthreads);
+	fclose(f);
+	if (ret < 0) {
+		ksh_freemodel(model);
+		return NULL;
+	}
+	return model;
+}
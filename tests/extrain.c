@@ -0,0 +1,72 @@
+// out-of-core training has to count the same as ksh_trainmarkov, however many
+// runs it spills along the way, and leave no temporary files behind
+#include <dirent.h>
+#include <unistd.h>
+#include "libkoishi.h"
+#include "corpus.h"
+
+#define NSTRINGS 20000
+
+int
+main(void)
+{
+	const char **strings = corpus(NSTRINGS, 6);
+	// longer than the smallest buffer on its own
+	char *longest = malloc(10000);
+	for (int i = 0; i < 9999; i++)
+		longest[i] = "koishi"[i % 6];
+	longest[9999] = 0;
+	ksh_model_t *ref = ksh_createmodel(10, NULL, 0);
+	for (size_t i = 0; i < NSTRINGS; i++)
+		ksh_trainmarkov(ref, strings[i]);
+	ksh_trainmarkov(ref, longest);
+
+	char dir[] = "/tmp/koishi-extrain-XXXXXX";
+	if (!mkdtemp(dir)) {
+		puts("extrain: couldn't make a temporary directory");
+		return 1;
+	}
+	int failed = 0;
+	static const uint64_t membudget[] = {0, 1<<16, 1<<26};
+	for (int m = 0; m < sizeof(membudget)/sizeof(membudget[0]); m++) {
+		ksh_extrain_t *job = ksh_extrain_begin(dir, membudget[m]);
+		int ret = job ? 0 : -1;
+		for (size_t i = 0; i < NSTRINGS && ret == 0; i++) {
+			ret = ksh_extrain_add(job, strings[i]);
+			if (i == NSTRINGS / 2 && ret == 0)
+				ret = ksh_extrain_add(job, longest);
+		}
+		char *data = NULL;
+		size_t len = 0;
+		FILE *f = open_memstream(&data, &len);
+		if (job && ksh_extrain_finish(job, f) < 0)
+			ret = -1;
+		fclose(f);
+		ksh_model_t *model = ret < 0 ? NULL : loaded(data, len, 10, 1);
+		if (!model || !same_counts(model, ref)) {
+			printf("extrain: with a budget of %lu bytes it's different from ksh_trainmarkov\n",
+				(unsigned long)membudget[m]);
+			failed = 1;
+		}
+		if (model)
+			ksh_freemodel(model);
+		free(data);
+
+		DIR *d = opendir(dir);
+		struct dirent *e;
+		while ((e = readdir(d)) != NULL) {
+			if (strcmp(e->d_name, ".") && strcmp(e->d_name, "..")) {
+				printf("extrain: %s was left behind\n", e->d_name);
+				failed = 1;
+			}
+		}
+		closedir(d);
+	}
+	rmdir(dir);
+
+	ksh_freemodel(ref);
+	free(longest);
+	free(strings);
+	puts(failed ? "extrain: FAILED" : "extrain: ok");
+	return failed;
+}
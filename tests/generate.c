@@ -0,0 +1,74 @@
+// ksh_createstring_ex has to keep the prefix and the length limits every time
+// it succeeds, and with limits it knows exactly it can't fail on one try and
+// then succeed on another
+#include "libkoishi.h"
+#include "corpus.h"
+
+#define NSTRINGS 5000
+#define TRIES 300
+
+static int
+codepoints(const char *s)
+{
+	int n = 0;
+	for (; *s; s++)
+		n += (*s & 0xC0) != 0x80;
+	return n;
+}
+
+int
+main(void)
+{
+	const char **strings = corpus(NSTRINGS, 4);
+	ksh_model_t *model = ksh_createmodel(10, NULL, 0);
+	for (size_t i = 0; i < NSTRINGS; i++)
+		ksh_trainmarkov(model, strings[i]);
+
+	int failed = 0;
+	static const char *prefixes[] = {NULL, "", "ko", "koshi", "ж", "こい", "zz"};
+	static const int limits[][2] = {{0, 0}, {1, 5}, {4, 8}, {10, 20}, {3, 3}, {0, 64}, {25, 40}, {40, 0}, {7, 6}};
+	for (int p = 0; p < sizeof(prefixes)/sizeof(prefixes[0]); p++) {
+		for (int l = 0; l < sizeof(limits)/sizeof(limits[0]); l++) {
+			const char *prefix = prefixes[p];
+			int minlen = limits[l][0], maxlen = limits[l][1];
+			int ok = 0, notok = 0;
+			for (int i = 0; i < TRIES; i++) {
+				char buf[512];
+				int n = ksh_createstring_ex(model, buf, sizeof(buf), prefix, minlen, maxlen);
+				if (n < 0) {
+					notok++;
+					continue;
+				}
+				ok++;
+				if (n != codepoints(buf) || n < minlen || (maxlen > 0 && n > maxlen)
+						|| (prefix && strncmp(buf, prefix, strlen(prefix)))) {
+					printf("generate: \"%s\" (%d) from prefix \"%s\" and limits %d to %d\n",
+						buf, n, prefix ? prefix : "(null)", minlen, maxlen);
+					failed = 1;
+					break;
+				}
+			}
+			if (ok && notok && maxlen > 0 && maxlen <= 64) {
+				printf("generate: prefix \"%s\" with limits %d to %d worked %d times out of %d\n",
+					prefix ? prefix : "(null)", minlen, maxlen, ok, TRIES);
+				failed = 1;
+			}
+		}
+	}
+	// limits that can obviously be met have to be
+	char buf[512];
+	if (ksh_createstring_ex(model, buf, sizeof(buf), "ko", 2, 10) < 0
+			|| ksh_createstring_ex(model, buf, sizeof(buf), NULL, 1, 1) < 0) {
+		puts("generate: easy limits weren't met");
+		failed = 1;
+	}
+	if (ksh_createstring_ex(model, buf, sizeof(buf), "koshi", 1, 4) >= 0) {
+		puts("generate: a prefix longer than maxlen was allowed");
+		failed = 1;
+	}
+
+	ksh_freemodel(model);
+	free(strings);
+	puts(failed ? "generate: FAILED" : "generate: ok");
+	return failed;
+}
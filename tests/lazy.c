@@ -0,0 +1,90 @@
+// a lazily opened model has to generate and score exactly like the same file
+// loaded in full, while keeping the chunks it has in memory under maxresident.
+// the resident count is internal, so the library gets built right into the test
+#include "../libkoishi/libkoishi.c"
+#include "corpus.h"
+
+#define NSTRINGS 20000
+#define NGENERATED 2000
+
+static int
+loadedchunks(ksh_model_t *model)
+{
+	int n = 0;
+	for (uint64_t c = 0; c < model->lazy->nchunks; c++)
+		n += model->lazy->lastuse[c] != 0;
+	return n;
+}
+
+int
+main(void)
+{
+	const char **strings = corpus(NSTRINGS, 3);
+	ksh_model_t *model = ksh_createmodel(12, NULL, 0);
+	for (size_t i = 0; i < NSTRINGS; i++)
+		ksh_trainmarkov(model, strings[i]);
+	char path[] = "/tmp/koishi-lazy-XXXXXX";
+	int fd = mkstemp(path);
+	FILE *f = fdopen(fd, "w");
+	if (!f || ksh_savemodel_chunked(model, f, 256) < 0 || fclose(f) != 0) {
+		puts("lazy: couldn't write the model file");
+		return 1;
+	}
+
+	int failed = 0;
+	static const uint64_t maxresident[] = {0, 1, 16384};
+	for (int m = 0; m < sizeof(maxresident)/sizeof(maxresident[0]); m++) {
+		ksh_model_t *full = ksh_createmodel(12, NULL, 5);
+		f = fopen(path, "r");
+		ksh_loadmodel(full, f);
+		fclose(f);
+		ksh_model_t *lazy = ksh_openmodel(path, maxresident[m], NULL, 5);
+		if (!lazy || !lazy->lazy) {
+			puts("lazy: the model didn't open lazily");
+			return 1;
+		}
+		int over = 0;
+		for (int i = 0; i < NGENERATED; i++) {
+			char a[64], b[64];
+			ksh_createstring(full, a, sizeof(a));
+			ksh_createstring(lazy, b, sizeof(b));
+			if (strcmp(a, b)) {
+				printf("lazy: with maxresident %lu, string %d was \"%s\" instead of \"%s\"\n",
+					(unsigned long)maxresident[m], i, b, a);
+				failed = 1;
+				break;
+			}
+			// a single chunk bigger than the limit is all that can go over it
+			if (maxresident[m] && lazy->lazy->resident > maxresident[m] && loadedchunks(lazy) > 1)
+				over = 1;
+		}
+		if (over) {
+			printf("lazy: more than %lu bytes of chunks stayed loaded\n", (unsigned long)maxresident[m]);
+			failed = 1;
+		}
+		double fullscores[100], lazyscores[100];
+		ksh_scorestrings(full, strings, 100, fullscores);
+		ksh_scorestrings(lazy, strings, 100, lazyscores);
+		if (memcmp(fullscores, lazyscores, sizeof(fullscores))) {
+			printf("lazy: with maxresident %lu, the scores are different\n", (unsigned long)maxresident[m]);
+			failed = 1;
+		}
+		// chunks that were trained on stay, so nothing gets lost to eviction
+		for (size_t i = 0; i < 500; i++) {
+			ksh_trainmarkov(full, strings[NSTRINGS - 1 - i]);
+			ksh_trainmarkov(lazy, strings[NSTRINGS - 1 - i]);
+		}
+		if (!same_counts(full, lazy)) {
+			printf("lazy: with maxresident %lu, training came out different\n", (unsigned long)maxresident[m]);
+			failed = 1;
+		}
+		ksh_freemodel(full);
+		ksh_freemodel(lazy);
+	}
+
+	unlink(path);
+	ksh_freemodel(model);
+	free(strings);
+	puts(failed ? "lazy: FAILED" : "lazy: ok");
+	return failed;
+}
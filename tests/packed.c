@@ -0,0 +1,90 @@
+// the packed format, compressed or not, has to load back to the same counts,
+// and a truncated or corrupted file has to be refused or at least load safely
+#include "libkoishi.h"
+#include "corpus.h"
+
+#define NSTRINGS 20000
+#define NCORRUPT 300
+
+int
+main(void)
+{
+	const char **strings = corpus(NSTRINGS, 8);
+	ksh_model_t *model = ksh_createmodel(10, NULL, 0);
+	for (size_t i = 0; i < NSTRINGS; i++)
+		ksh_trainmarkov(model, strings[i]);
+	size_t plainlen;
+	free(saved(model, &plainlen));
+
+	int failed = 0;
+	char *first = NULL;
+	size_t firstlen = 0;
+	for (int compress = 0; compress <= 1; compress++) {
+		char *data = NULL;
+		size_t len = 0;
+		FILE *f = open_memstream(&data, &len);
+		if (ksh_savemodel_packed(model, f, compress) < 0) {
+			printf("packed: saving with compress %d failed\n", compress);
+			return 1;
+		}
+		fclose(f);
+		if (len >= plainlen) {
+			printf("packed: %zu bytes with compress %d, %zu without packing\n", len, compress, plainlen);
+			failed = 1;
+		}
+		for (int mapsize = 6; mapsize <= 12; mapsize += 3) {
+			ksh_model_t *back = loaded(data, len, mapsize, 1);
+			if (!back || !same_counts(back, model)) {
+				printf("packed: compress %d into mapsize %d came back different\n", compress, mapsize);
+				failed = 1;
+			}
+			// compressed or not, the rules come back in the same order
+			size_t backlen = 0;
+			char *backdata = back && mapsize == 9 ? saved(back, &backlen) : NULL;
+			if (backdata && !first) {
+				first = backdata;
+				firstlen = backlen;
+			} else if (backdata) {
+				if (backlen != firstlen || memcmp(backdata, first, backlen)) {
+					puts("packed: the compressed file came back in a different order");
+					failed = 1;
+				}
+				free(backdata);
+			}
+			if (back)
+				ksh_freemodel(back);
+		}
+		for (size_t cut = 0; cut < len; cut += cut < 64 ? 1 : len / 300 + 1) {
+			ksh_model_t *back = loaded(data, cut, 10, 1);
+			if (back) {
+				printf("packed: compress %d cut to %zu of %zu bytes loaded\n", compress, cut, len);
+				failed = 1;
+				ksh_freemodel(back);
+			}
+		}
+		// whatever still loads after a few flipped bytes, the sanitizers
+		// catch it if that reads out of bounds
+		char *copy = malloc(len);
+		uint32_t x = 1;
+		for (int i = 0; i < NCORRUPT; i++) {
+			memcpy(copy, data, len);
+			for (int j = 0; j < 1 + i % 4; j++) {
+				x = x * 1103515245 + 12345;
+				size_t at = (x >> 8) % len;
+				x = x * 1103515245 + 12345;
+				copy[at] ^= 1 << ((x >> 16) & 7);
+			}
+			ksh_model_t *back = loaded(copy, len, 10, 1);
+			if (back)
+				ksh_freemodel(back);
+		}
+		free(copy);
+		free(data);
+	}
+
+	free(first);
+	ksh_freemodel(model);
+	free(strings);
+	puts(failed ? "packed: FAILED" : "packed: ok");
+	return failed;
+}
@@ -0,0 +1,107 @@
+// training on several threads has to give the same model, byte for byte, as
+// training on one, and the same bloom filter of trained strings
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libkoishi.h"
+
+#define NSTRINGS 30000 // several rounds worth with any thread count
+#define MAXLEN 24
+
+static const char *syllables[] = {
+	"ko", "i", "shi", "me", "ji", "sa", "to", "ri", "o", "ku", "u", "ne",
+	"ą", "ж", "ę", "ß", "ー", "の", "こ", "い", "し",
+};
+
+static char *
+saved(ksh_model_t *model, size_t *len)
+{
+	char *data = NULL;
+	FILE *f = open_memstream(&data, len);
+	ksh_savemodel(model, f);
+	fclose(f);
+	return data;
+}
+
+int
+main(void)
+{
+	// made up strings, with some invalid bytes mixed in
+	const char **strings = malloc(NSTRINGS * sizeof(char*));
+	size_t *lens = malloc(NSTRINGS * sizeof(size_t));
+	char *buf = malloc(NSTRINGS * MAXLEN);
+	uint32_t x = 1;
+	for (int i = 0; i < NSTRINGS; i++) {
+		char *s = &buf[i * MAXLEN];
+		size_t len = 0;
+		while (1) {
+			x = x * 1103515245 + 12345;
+			const char *syl = syllables[(x >> 16) % (sizeof(syllables)/sizeof(syllables[0]))];
+			if (len + strlen(syl) >= MAXLEN || ((x >> 8) & 7) == 0)
+				break;
+			memcpy(&s[len], syl, strlen(syl));
+			len += strlen(syl);
+		}
+		if ((x & 0xFF) == 0)
+			s[len++] = '\xC4'; // the start of a character that never comes
+		strings[i] = s;
+		lens[i] = len;
+	}
+
+	int failed = 0;
+	size_t reflen = 0;
+	char *ref = NULL;
+	uint64_t *refseen = NULL, refbits = 0;
+	for (int nthreads = 1; nthreads <= 8; nthreads++) {
+		ksh_model_t *model = ksh_createmodel(8, NULL, 0);
+		if (ksh_reserve(model, 20000) < 0 || ksh_trackrecords(model, NSTRINGS, 10) < 0
+				|| ksh_trainmarkov_parallel(model, strings, lens, NSTRINGS, nthreads) < 0) {
+			printf("parallel: training with %d threads failed\n", nthreads);
+			return 1;
+		}
+		size_t len;
+		char *data = saved(model, &len);
+		if (!ref) {
+			ref = data;
+			reflen = len;
+			refbits = model->seenbits;
+			refseen = malloc(refbits/8);
+			memcpy(refseen, model->seen, refbits/8);
+		} else {
+			if (len != reflen || memcmp(data, ref, len)) {
+				printf("parallel: the model trained with %d threads is different\n", nthreads);
+				failed = 1;
+			}
+			if (model->seenbits != refbits || memcmp(model->seen, refseen, refbits/8)) {
+				printf("parallel: the bloom filter with %d threads is different\n", nthreads);
+				failed = 1;
+			}
+			free(data);
+		}
+		ksh_freemodel(model);
+	}
+	// and on a model that already has rules of its own
+	ksh_model_t *one = ksh_createmodel(10, NULL, 0), *many = ksh_createmodel(10, NULL, 0);
+	ksh_trainmarkov_parallel(one, strings, lens, 1000, 1);
+	ksh_trainmarkov_parallel(many, strings, lens, 1000, 1);
+	ksh_trainmarkov_parallel(one, strings + 1000, lens + 1000, NSTRINGS - 1000, 1);
+	ksh_trainmarkov_parallel(many, strings + 1000, lens + 1000, NSTRINGS - 1000, 4);
+	size_t len1, len2;
+	char *data1 = saved(one, &len1), *data2 = saved(many, &len2);
+	if (len1 != len2 || memcmp(data1, data2, len1)) {
+		puts("parallel: training on top of existing rules is different");
+		failed = 1;
+	}
+	free(data1);
+	free(data2);
+	ksh_freemodel(one);
+	ksh_freemodel(many);
+
+	free(ref);
+	free(refseen);
+	free(strings);
+	free(lens);
+	free(buf);
+	puts(failed ? "parallel: FAILED" : "parallel: ok");
+	return failed;
+}
@@ -0,0 +1,69 @@
+// known answers for philox4x32-10, from the random123 distribution's kat_vectors,
+// and the properties ksh_createstring_at promises on top of it.
+// philox_block is static, so the library gets built right into the test
+#include "../libkoishi/libkoishi.c"
+
+static const struct {
+	uint32_t ctr[4], key[2], out[4];
+} kat[] = {
+	{{0, 0, 0, 0}, {0, 0},
+		{0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8}},
+	{{0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff}, {0xffffffff, 0xffffffff},
+		{0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd}},
+	{{0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344}, {0xa4093822, 0x299f31d0},
+		{0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1}},
+};
+
+static const char *corpus[] = {
+	"koishi", "komeiji", "satori", "kokoro", "kogasa", "kasen", "koakuma",
+	"orin", "okuu", "sanae", "suwako", "kanako", "hatate", "aya",
+};
+
+int
+main(void)
+{
+	int failed = 0;
+	for (size_t i = 0; i < sizeof(kat)/sizeof(kat[0]); i++) {
+		uint32_t out[4];
+		philox_block(kat[i].ctr, kat[i].key, out);
+		if (memcmp(out, kat[i].out, sizeof(out))) {
+			printf("philox: vector %zu gave %08x %08x %08x %08x\n", i, out[0], out[1], out[2], out[3]);
+			failed = 1;
+		}
+	}
+
+	ksh_model_t *model = ksh_createmodel(8, NULL, 0);
+	for (size_t i = 0; i < sizeof(corpus)/sizeof(corpus[0]); i++)
+		ksh_trainmarkov(model, corpus[i]);
+	char buf[64], again[64];
+	if (ksh_createstring_at(model, 0, 0, buf, sizeof(buf)) != -1) {
+		puts("philox: ksh_createstring_at worked without the philox rng");
+		failed = 1;
+	}
+	ksh_setrng(model, KSH_RNG_PHILOX, 42);
+	// the strings have to come out the same in any order, and in between ordinary generation
+	#define N 64
+	char forward[N][64];
+	for (int i = 0; i < N; i++)
+		ksh_createstring_at(model, 7, i, forward[i], 64);
+	for (int i = N-1; i >= 0; i--) {
+		ksh_createstring(model, buf, sizeof(buf));
+		ksh_createstring_at(model, 7, i, again, sizeof(again));
+		if (strcmp(forward[i], again)) {
+			printf("philox: string %d of stream 7 was \"%s\", then \"%s\"\n", i, forward[i], again);
+			failed = 1;
+		}
+	}
+	int differs = 0;
+	for (int i = 0; i < N; i++) {
+		ksh_createstring_at(model, 8, i, buf, sizeof(buf));
+		differs |= strcmp(forward[i], buf) != 0;
+	}
+	if (!differs) {
+		puts("philox: streams 7 and 8 are the same");
+		failed = 1;
+	}
+	ksh_freemodel(model);
+	puts(failed ? "philox: FAILED" : "philox: ok");
+	return failed;
+}
@@ -0,0 +1,119 @@
+// smoke test for koishi.hpp and the length-taking calls under it
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "koishi.hpp"
+
+static int failed = 0;
+
+#define CHECK(_COND) do { \
+	if (!(_COND)) { \
+		std::printf("wrapper:%d: %s\n", __LINE__, #_COND); \
+		failed = 1; \
+	} \
+} while (0)
+
+static std::string
+saved(koishi::Model &model)
+{
+	char *data = nullptr;
+	std::size_t len = 0;
+	std::FILE *f = open_memstream(&data, &len);
+	model.save(f);
+	std::fclose(f);
+	std::string out(data, len);
+	std::free(data);
+	return out;
+}
+
+int
+main()
+{
+	std::vector<std::string> strings = {"hello world", "hella", "koishi komeiji", "ąжę"};
+	// the same strings as views into one buffer, none of them 0-terminated
+	std::string joined = "hello world|hella|koishi komeiji|ąжęX";
+	std::string_view all(joined);
+	std::vector<std::string_view> views = {all.substr(0, 11), all.substr(12, 5), all.substr(18, 14), all.substr(33, 6)};
+
+	koishi::Model a(10, 1), b(10, 1);
+	for (auto &s : strings)
+		ksh_trainmarkov(a.get(), s.c_str());
+	b.train_all(views);
+	CHECK(saved(a) == saved(b));
+	CHECK(a.rules() == b.rules());
+
+	// a truncated character at the end of a view is dropped, not read past
+	koishi::Model c(8, 1), d(8, 1);
+	c.train(std::string_view("ab\xc4", 3));
+	d.train("ab");
+	CHECK(saved(c) == saved(d));
+
+	std::string out;
+	out.reserve(1024);
+	std::size_t cap = out.capacity();
+	for (int i = 0; i < 100; i++) {
+		out.clear();
+		a.generate(out, 32);
+		CHECK(out.size() <= 32);
+	}
+	CHECK(out.capacity() == cap);
+	out.clear();
+	a.generate_n(out, 3);
+	CHECK(std::count(out.begin(), out.end(), '\n') >= 3);
+
+	std::vector<double> batched, single;
+	b.score_all(views, std::back_inserter(batched));
+	for (auto &s : strings)
+		single.push_back(a.score(s));
+	CHECK(batched.size() == single.size());
+	for (std::size_t i = 0; i < batched.size() && i < single.size(); i++)
+		CHECK(std::fabs(batched[i] - single[i]) < 1e-12 && batched[i] < 0);
+
+	koishi::Model moved = std::move(a);
+	CHECK(!a && moved);
+	CHECK(moved.rules() == b.rules());
+
+	bool threw = false;
+	try {
+		moved.generate_at(out, 0, 0);
+	} catch (const std::logic_error &) {
+		threw = true;
+	}
+	CHECK(threw);
+	moved.set_rng(KSH_RNG_PHILOX, 3);
+	moved.freeze();
+	std::string at1, at2;
+	moved.generate_at(at1, 0, 5);
+	moved.generate(out);
+	moved.generate_at(at2, 0, 5);
+	CHECK(at1 == at2);
+
+	koishi::Model clone = moved.clone();
+	CHECK(saved(clone) == saved(moved));
+	{
+		koishi::Model overlay = koishi::Model::overlay(moved);
+		overlay.train("zzzz");
+		CHECK(overlay.rules() == 5);
+		// the base stays frozen while the overlay is on it
+		threw = false;
+		try {
+			moved.thaw();
+		} catch (const std::runtime_error &) {
+			threw = true;
+		}
+		CHECK(threw);
+		// the base can change hands while the overlay is on it
+		koishi::Model base = std::move(moved);
+		CHECK(overlay.generate(out).size() > 0);
+		moved = std::move(base);
+	}
+	moved.thaw();
+
+	std::puts(failed ? "wrapper: FAILED" : "wrapper: ok");
+	return failed;
+}